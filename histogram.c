@@ -0,0 +1,68 @@
+#include "histogram.h"
+
+/* Returns the bucket that holds value.
+ */
+static int bucket_of(unsigned long long value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + 
+           ((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Returns the largest value that falls in the given bucket.
+ */
+static long long bucket_limit(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / HIST_SUB_BUCKETS - 1;
+    long long base = (long long) (HIST_SUB_BUCKETS + 
+                                  bucket % HIST_SUB_BUCKETS) << shift;
+    return base + ((1LL << shift) - 1);
+}
+
+void record_sample(Histogram *hist, long long value) {
+    if (value < 0) {
+        value = 0;
+    }
+    hist->buckets[bucket_of(value)]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+long long get_percentile(Histogram *hist, double percentile) {
+    if (hist->count == 0) {
+        return 0;
+    }
+
+    long long rank = (long long) (hist->count * percentile / 100.0);
+    if (rank >= hist->count) {
+        rank = hist->count - 1;
+    }
+
+    long long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) {
+            long long limit = bucket_limit(i);
+            return limit < hist->max ? limit : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void merge_histogram(Histogram *into, Histogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+/* Log-linear histogram of non-negative integer samples. Every power of two
+ * is split into HIST_SUB_BUCKETS buckets, so a percentile is off by at most
+ * 1/HIST_SUB_BUCKETS of its value. Recording a sample is a few arithmetic
+ * operations and one increment, cheap enough for hot paths.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+	long long count;
+	long long sum;
+	long long max;
+	long long buckets[HIST_BUCKETS];
+};
+typedef struct histogram Histogram;
+
+/* Adds a sample to the given histogram. Negative samples count as 0.
+ */
+void record_sample(Histogram *, long long);
+
+/* Returns an upper bound for the given percentile (0 to 100) of the samples
+ * in the histogram, or 0 if it is empty.
+ */
+long long get_percentile(Histogram *, double);
+
+/* Adds every sample of the second histogram to the first.
+ */
+void merge_histogram(Histogram *, Histogram *);
+
+#endif
@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include "socket.h"
+#include "histogram.h"
+
+/* Load generator for the job server. Every connection keeps one emit job
+ * (see jobs/emit.c) running and watches it, optionally also watches the job
+ * of the next connection, polls the job list, and kills some of its jobs
+ * part way. At the end it prints throughput and latency percentiles, and
+ * with -s the server's counters of loop turns, writes and io_uring
+ * submissions, which tell the system calls made by the epoll and io_uring
+ * (jobserver -u) loops apart. They count from the server's start.
+ *
+ * Usage: jobbench [-p port] [-H host] [-c connections] [-d seconds]
+ *                 [-r lines/s] [-l line length] [-n lines per job]
+ *                 [-k kill every nth job] [-i jobs interval ms] [-w] [-s]
+ *
+ * The server must run from the directory holding jobs/, on the same host.
+ */
+
+#define MAX_CONNECTIONS 256
+#define MAX_PENDING_ACKS 64
+#define INBUF_SIZE 65536
+
+#ifndef PORT
+  #define PORT 55555
+#endif
+
+typedef enum {ACK_RUN, ACK_WATCH, ACK_JOBS, N_ACK_KINDS} AckKind;
+static const char *ack_names[] = {"ack run", "ack watch", "ack jobs"};
+
+struct pending_ack {
+	AckKind kind;
+	int pid;
+	long long sent;
+};
+
+struct connection {
+	int fd;
+	char inbuf[INBUF_SIZE];
+	int inbuf_len;
+	struct pending_ack pending[MAX_PENDING_ACKS];
+	int pending_first;
+	int pending_count;
+	int pid;
+	int run_queued;
+	int got_output;
+	long long run_sent;
+	long long kill_sent;
+	int runs;
+	int watching;
+};
+typedef struct connection Connection;
+
+// Settings, from the command line
+int port = PORT;
+char *host = "localhost";
+int n_connections = 8;
+int duration = 5;
+int rate = 1000;
+int line_length = 64;
+int lines_per_job = 2000;
+int kill_every = 4;
+int jobs_interval_ms = 100;
+int watch_neighbour = 0;
+int server_stats = 0;
+
+Connection connections[MAX_CONNECTIONS];
+int stopping;
+
+// Results
+Histogram acks[N_ACK_KINDS];
+Histogram spawn_to_output;
+Histogram fan_out;
+Histogram kill_to_exit;
+long long commands_sent;
+long long lines_received;
+long long bytes_received;
+
+long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Sends a command, and expects a [SERVER] reply for it if kind is an
+ * AckKind. Replies about a job are matched to the command by pid, 0 if the
+ * command is not about one.
+ */
+void send_command(Connection *conn, int kind, int pid, const char *format, 
+                  ...) __attribute__((format(printf, 4, 5)));
+
+void send_command(Connection *conn, int kind, int pid, const char *format, 
+                  ...) {
+    char cmd[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(cmd, sizeof(cmd) - 2, format, args);
+    va_end(args);
+    cmd[len++] = '\r';
+    cmd[len++] = '\n';
+
+    // Commands are short, a full socket buffer here means the server is stuck
+    if (write(conn->fd, cmd, len) != len) {
+        perror("write");
+        exit(1);
+    }
+    commands_sent++;
+
+    if (kind < N_ACK_KINDS) {
+        if (conn->pending_count == MAX_PENDING_ACKS) {
+            fprintf(stderr, "Too many commands waiting for a reply\n");
+            exit(1);
+        }
+        int slot = (conn->pending_first + conn->pending_count) % MAX_PENDING_ACKS;
+        conn->pending[slot].kind = kind;
+        conn->pending[slot].pid = pid;
+        conn->pending[slot].sent = now_ns();
+        conn->pending_count++;
+    }
+}
+
+void start_run(Connection *conn) {
+    conn->pid = 0;
+    conn->got_output = 0;
+    conn->kill_sent = 0;
+    conn->run_sent = now_ns();
+    conn->runs++;
+    send_command(conn, ACK_RUN, 0, "run emit %d %d %d", 
+                 rate, line_length, lines_per_job);
+}
+
+/* Returns 1 and sets *pid if the whole of line matches format, which holds
+ * a %d for a pid followed by a %n at its end, 0 otherwise.
+ */
+int match_reply(const char *line, const char *format, int *pid) {
+    int value;
+    int end = 0;
+    if (sscanf(line, format, &value, &end) != 1 || end == 0 || 
+            line[end] != '\0') {
+        return 0;
+    }
+    *pid = value;
+    return 1;
+}
+
+/* Returns the kind of command a [SERVER] line answers, and sets *pid to the
+ * job it is about, or to 0 if it could answer a command about any job.
+ * Returns -1 for lines that answer none of the commands acks are timed for,
+ * such as a kill that lost the race with its job's exit.
+ */
+int reply_kind(char *line, int *pid) {
+    *pid = 0;
+    if (match_reply(line, "[SERVER] Job %d created%n", pid) || 
+            strstr(line, " queued at position ") != NULL || 
+            strcmp(line, "[SERVER] MAXJOBS exceeded") == 0 || 
+            strncmp(line, "[SERVER] Could not start job", 28) == 0) {
+        return ACK_RUN;
+    }
+    if (match_reply(line, "[SERVER] Watching job %d%n", pid) || 
+            match_reply(line, "[SERVER] No longer watching job %d%n", pid) || 
+            match_reply(line, "[SERVER] Job %d not found%n", pid)) {
+        return ACK_WATCH;
+    }
+    if (strncmp(line, "[SERVER] Could not reach shard", 30) == 0) {
+        return ACK_WATCH;
+    }
+    if (strcmp(line, "[SERVER] No currently running jobs") == 0 || 
+            strspn(line + 8, " 0123456789") == strlen(line + 8)) {
+        return ACK_JOBS;
+    }
+    return -1;
+}
+
+/* Records the reply to the oldest command of its kind, and about its job,
+ * still waiting for one. The server may send replies that no timed command
+ * asked for, so they are matched by what they say rather than by order.
+ */
+void handle_reply(Connection *conn, char *line) {
+    int pid;
+    if (match_reply(line, "[SERVER] Job %d created%n", &pid) && 
+            conn->run_queued) {
+        // A queued run started, its ack was the "queued" reply
+        conn->run_queued = 0;
+        conn->pid = pid;
+        return;
+    }
+    int kind = reply_kind(line, &pid);
+    if (kind < 0) {
+        return;
+    }
+
+    int i;
+    struct pending_ack *ack = NULL;
+    for (i = 0; i < conn->pending_count; i++) {
+        ack = &(conn->pending[(conn->pending_first + i) % MAX_PENDING_ACKS]);
+        if (ack->kind == kind && 
+                (pid == 0 || ack->pid == 0 || ack->pid == pid)) {
+            break;
+        }
+    }
+    if (i == conn->pending_count) {
+        // A not found for a kill, rather than for a watch
+        return;
+    }
+    record_sample(&acks[kind], (now_ns() - ack->sent) / 1000);
+
+    // Later commands move up to close the gap
+    for (; i + 1 < conn->pending_count; i++) {
+        conn->pending[(conn->pending_first + i) % MAX_PENDING_ACKS] = 
+            conn->pending[(conn->pending_first + i + 1) % MAX_PENDING_ACKS];
+    }
+    conn->pending_count--;
+
+    if (kind == ACK_RUN) {
+        if (pid > 0) {
+            conn->pid = pid;
+        } else if (strstr(line, "queued") != NULL) {
+            conn->run_queued = 1;
+        } else {
+            fprintf(stderr, "Run failed: %s\n", line);
+            exit(1);
+        }
+    }
+}
+
+/* Handles a line of job output, or the announcement of a job's exit.
+ */
+void handle_job_line(Connection *conn, char *line) {
+    int pid;
+    int offset;
+    if (sscanf(line, "[%*[JOBjob] %d] %n", &pid, &offset) != 1) {
+        return;
+    }
+    char *text = line + offset;
+
+    if (strncmp(text, "Exited", 6) == 0) {
+        if (pid == conn->watching) {
+            conn->watching = 0;
+        }
+        if (pid == conn->pid) {
+            if (conn->kill_sent) {
+                record_sample(&kill_to_exit, (now_ns() - conn->kill_sent) / 1000);
+            }
+            conn->pid = 0;
+            if (!stopping) {
+                start_run(conn);
+            }
+        }
+        return;
+    }
+
+    long long written;
+    if (sscanf(text, "%lld", &written) != 1) {
+        return;
+    }
+    long long now = now_ns();
+    record_sample(&fan_out, (now - written) / 1000);
+    lines_received++;
+
+    if (pid == conn->pid && !conn->got_output) {
+        conn->got_output = 1;
+        record_sample(&spawn_to_output, (now - conn->run_sent) / 1000);
+        if (kill_every > 0 && conn->runs % kill_every == 0 && !stopping) {
+            conn->kill_sent = now;
+            send_command(conn, N_ACK_KINDS, pid, "kill %d", pid);
+        }
+    }
+}
+
+/* Reads what the server sent to a connection and handles every full line.
+ */
+void read_connection(Connection *conn) {
+    int nbytes = read(conn->fd, conn->inbuf + conn->inbuf_len, 
+                      INBUF_SIZE - conn->inbuf_len);
+    if (nbytes == 0) {
+        fprintf(stderr, "Server closed the connection\n");
+        exit(1);
+    } else if (nbytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
+        perror("read");
+        exit(1);
+    }
+    bytes_received += nbytes;
+    conn->inbuf_len += nbytes;
+
+    char *start = conn->inbuf;
+    char *end = conn->inbuf + conn->inbuf_len;
+    char *newline;
+    while ((newline = memchr(start, '\n', end - start)) != NULL) {
+        *newline = '\0';
+        if (newline > start && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        if (strncmp(start, "[SERVER]", 8) == 0) {
+            handle_reply(conn, start);
+        } else if (start[0] == '[') {
+            handle_job_line(conn, start);
+        }
+        start = newline + 1;
+    }
+
+    conn->inbuf_len = end - start;
+    memmove(conn->inbuf, start, conn->inbuf_len);
+    if (conn->inbuf_len == INBUF_SIZE) {
+        // Drop a line that does not fit
+        conn->inbuf_len = 0;
+    }
+}
+
+/* Sends the periodic commands of every connection.
+ */
+void tick(void) {
+    for (int i = 0; i < n_connections; i++) {
+        Connection *conn = &(connections[i]);
+        send_command(conn, ACK_JOBS, 0, "jobs");
+
+        if (watch_neighbour && n_connections > 1) {
+            int neighbour_pid = connections[(i + 1) % n_connections].pid;
+            if (neighbour_pid > 0 && conn->watching != neighbour_pid) {
+                conn->watching = neighbour_pid;
+                send_command(conn, ACK_WATCH, neighbour_pid, "watch %d", 
+                             neighbour_pid);
+            }
+        }
+    }
+}
+
+/* Asks the server for its stats on a connection of its own, and prints the
+ * lines about system calls and batching until the server stays quiet for
+ * 200ms.
+ */
+void print_server_stats(void) {
+    int fd = connect_to_server(port, host);
+    char cmd[] = "stats\r\n";
+    if (write(fd, cmd, sizeof(cmd) - 1) != sizeof(cmd) - 1) {
+        perror("write");
+        exit(1);
+    }
+
+    char buf[INBUF_SIZE];
+    int len = 0;
+    struct pollfd pollfd = {fd, POLLIN, 0};
+    while (len < INBUF_SIZE - 1 && poll(&pollfd, 1, 200) > 0) {
+        int nbytes = read(fd, buf + len, INBUF_SIZE - 1 - len);
+        if (nbytes <= 0) {
+            break;
+        }
+        len += nbytes;
+    }
+    buf[len] = '\0';
+    close(fd);
+
+    printf("\nserver\n");
+    for (char *line = strtok(buf, "\r\n"); line != NULL; 
+            line = strtok(NULL, "\r\n")) {
+        if (strstr(line, "] loop:") || strstr(line, "] writes:") || 
+                strstr(line, "] uring:") || 
+                strstr(line, "] lines per batch:")) {
+            printf("%s\n", strchr(line, ' ') + 1);
+        }
+    }
+}
+
+void print_histogram(const char *name, Histogram *hist) {
+    printf("%-16s %10lld %10lld %10lld %10lld %10lld\n", name, hist->count, 
+           get_percentile(hist, 50), get_percentile(hist, 99), 
+           get_percentile(hist, 99.9), hist->max);
+}
+
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-p port] [-H host] [-c connections] "
+            "[-d seconds] [-r lines/s] [-l line length] [-n lines per job] "
+            "[-k kill every nth job] [-i jobs interval ms] [-w] [-s]\n", 
+            name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:H:c:d:r:l:n:k:i:ws")) != -1) {
+        switch (opt) {
+            case 'p': port = strtol(optarg, NULL, 10); break;
+            case 'H': host = optarg; break;
+            case 'c': n_connections = strtol(optarg, NULL, 10); break;
+            case 'd': duration = strtol(optarg, NULL, 10); break;
+            case 'r': rate = strtol(optarg, NULL, 10); break;
+            case 'l': line_length = strtol(optarg, NULL, 10); break;
+            case 'n': lines_per_job = strtol(optarg, NULL, 10); break;
+            case 'k': kill_every = strtol(optarg, NULL, 10); break;
+            case 'i': jobs_interval_ms = strtol(optarg, NULL, 10); break;
+            case 'w': watch_neighbour = 1; break;
+            case 's': server_stats = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (n_connections <= 0 || n_connections > MAX_CONNECTIONS || 
+            duration <= 0 || jobs_interval_ms <= 0) {
+        usage(argv[0]);
+    }
+
+    struct pollfd pollfds[MAX_CONNECTIONS];
+    for (int i = 0; i < n_connections; i++) {
+        connections[i].fd = connect_to_server(port, host);
+        fcntl(connections[i].fd, F_SETFL, O_NONBLOCK);
+        pollfds[i].fd = connections[i].fd;
+        pollfds[i].events = POLLIN;
+    }
+
+    long long start = now_ns();
+    long long deadline = start + duration * 1000000000LL;
+    long long next_tick = start;
+    for (int i = 0; i < n_connections; i++) {
+        start_run(&(connections[i]));
+    }
+
+    // Run for the given duration, then give outstanding replies a second
+    long long now;
+    while ((now = now_ns()) < deadline + 1000000000LL) {
+        if (!stopping && now >= deadline) {
+            stopping = 1;
+            for (int i = 0; i < n_connections; i++) {
+                if (connections[i].pid > 0) {
+                    send_command(&(connections[i]), N_ACK_KINDS, 
+                                 connections[i].pid, "kill %d", 
+                                 connections[i].pid);
+                }
+            }
+        }
+        if (!stopping && now >= next_tick) {
+            tick();
+            next_tick += jobs_interval_ms * 1000000LL;
+        }
+
+        if (poll(pollfds, n_connections, 10) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        for (int i = 0; i < n_connections; i++) {
+            if (pollfds[i].revents) {
+                read_connection(&(connections[i]));
+            }
+        }
+    }
+
+    double seconds = duration;
+    long long runs = 0;
+    for (int i = 0; i < n_connections; i++) {
+        runs += connections[i].runs;
+        close(connections[i].fd);
+    }
+
+    printf("%d connections for %ds, emit %d lines/s of %d bytes, "
+           "%d lines per job\n", n_connections, duration, rate, line_length, 
+           lines_per_job);
+    printf("jobs run     %12lld (%.1f/s)\n", runs, runs / seconds);
+    printf("commands     %12lld (%.1f/s)\n", commands_sent, 
+           commands_sent / seconds);
+    printf("lines        %12lld (%.1f/s)\n", lines_received, 
+           lines_received / seconds);
+    printf("bytes        %12lld (%.2f MB/s)\n", bytes_received, 
+           bytes_received / seconds / 1e6);
+    printf("\n%-16s %10s %10s %10s %10s %10s\n", "latency (us)", "count", 
+           "p50", "p99", "p99.9", "max");
+    for (int i = 0; i < N_ACK_KINDS; i++) {
+        print_histogram(ack_names[i], &acks[i]);
+    }
+    print_histogram("spawn->output", &spawn_to_output);
+    print_histogram("fan-out", &fan_out);
+    print_histogram("kill->exit", &kill_to_exit);
+    if (server_stats) {
+        print_server_stats();
+    }
+
+    return 0;
+}
@@ -1,10 +1,24 @@
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <arpa/inet.h>
 
 #include "jobprotocol.h"
+#include "linesplit.h"
+
+Pool job_pool = POOL_INITIALIZER(sizeof(JobNode), JOB_SLAB);
+Pool client_pool = POOL_INITIALIZER(sizeof(Client), CLIENT_SLAB);
+Pool watcher_pool = POOL_INITIALIZER(sizeof(WatcherNode), WATCHER_SLAB);
+Pool buffer_pool = POOL_INITIALIZER(BUFSIZE + 1, BUFFER_SLAB);
+
+int scrollback_bytes = SCROLLBACK_BYTES;
 
 /* Example: Something like the function below might be useful
 
@@ -13,8 +27,89 @@
 int find_newline(const char *buf, int len);
 */ 
 
-JobNode* start_job(char *path, char *const args[]) {
-    JobNode *job = malloc(sizeof(JobNode));
+/* Launches path with fork() and execv(), with its stdout and stderr
+ * replaced by the given fds. Returns the new pid, or -1 on error.
+ */
+static int fork_process(char *path, char *const args[], int out_fd, int err_fd) {
+    int pid;
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {
+        // Undo the server's signal setup, which exec would otherwise keep
+        sigset_t no_signals;
+        sigemptyset(&no_signals);
+        sigprocmask(SIG_SETMASK, &no_signals, NULL);
+        signal(SIGPIPE, SIG_DFL);
+
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+
+        execv(path, args);
+        perror("exec");
+        exit(1);
+    }
+    return pid;
+}
+
+/* Returns the attributes every job is spawned with. They are the same for
+ * all of them, so they are only set up once.
+ */
+static posix_spawnattr_t *get_spawn_attr(void) {
+    static posix_spawnattr_t attr;
+    static int initialized = 0;
+    if (initialized) {
+        return &attr;
+    }
+    posix_spawnattr_init(&attr);
+
+    // Undo the server's signal setup, which exec would otherwise keep
+    sigset_t no_signals;
+    sigset_t default_signals;
+    sigemptyset(&no_signals);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    posix_spawnattr_setsigdefault(&attr, &default_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | 
+                                    POSIX_SPAWN_SETSIGDEF | 
+                                    POSIX_SPAWN_USEVFORK);
+    initialized = 1;
+    return &attr;
+}
+
+/* Launches path with posix_spawn(), with its stdout and stderr replaced by
+ * the given fds. The server's memory is shared with the child until it
+ * execs instead of being copied, so this does not get slower as the server
+ * grows. Returns the new pid, or -1 on error.
+ */
+static int spawn_process(char *path, char *const args[], int out_fd, int err_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+    pid_t pid;
+    int error = posix_spawn(&pid, path, &actions, get_spawn_attr(), args, 
+                            environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (error != 0) {
+        fprintf(stderr, "posix_spawn: %s: %s\n", path, strerror(error));
+        return -1;
+    }
+    return pid;
+}
+
+/* Creates the output pipes of a job and launches it with the given
+ * function. Every pipe end is close-on-exec, the write ends only survive
+ * in the job as its stdout and stderr.
+ */
+static JobNode* launch_job(char *path, char *const args[], 
+                    int (*launch)(char *, char *const[], int, int)) {
+    JobNode *job = pool_alloc(&job_pool);
     if (job == NULL) {
         perror("malloc");
         return NULL;
@@ -23,60 +118,277 @@ JobNode* start_job(char *path, char *const args[]) {
 
     int stdout_pipe[2];
     int stderr_pipe[2];
-    if (pipe(stdout_pipe) < 0 || pipe(stderr_pipe) < 0) {
+    if (pipe2(stdout_pipe, O_CLOEXEC) < 0) {
         perror("pipe");
-        free(job);
+        pool_free(&job_pool, job);
         return NULL;
     }
-
-    int pid;
-    if ((pid = fork()) < 0) {
-        perror("fork");
+    if (pipe2(stderr_pipe, O_CLOEXEC) < 0) {
+        perror("pipe");
         close(stdout_pipe[PIPE_READ]);
         close(stdout_pipe[PIPE_WRITE]);
-        close(stderr_pipe[PIPE_READ]);
-        close(stderr_pipe[PIPE_WRITE]);
-        free(job);
+        pool_free(&job_pool, job);
         return NULL;
-    } else if (pid == 0) {
-        close(stdout_pipe[PIPE_READ]);
-        close(stderr_pipe[PIPE_READ]);
-
-        dup2(stdout_pipe[PIPE_WRITE], STDOUT_FILENO);
-        dup2(stderr_pipe[PIPE_WRITE], STDERR_FILENO);
-
-        execv(path, args);
-        perror("exec");
-        exit(1);
     }
 
+    int pid = launch(path, args, stdout_pipe[PIPE_WRITE], 
+                     stderr_pipe[PIPE_WRITE]);
+
     close(stdout_pipe[PIPE_WRITE]);
     close(stderr_pipe[PIPE_WRITE]);
+    if (pid < 0) {
+        close(stdout_pipe[PIPE_READ]);
+        close(stderr_pipe[PIPE_READ]);
+        pool_free(&job_pool, job);
+        return NULL;
+    }
+    fcntl(stdout_pipe[PIPE_READ], F_SETFL, O_NONBLOCK);
+    fcntl(stderr_pipe[PIPE_READ], F_SETFL, O_NONBLOCK);
 
     job->pid = pid;
     job->stdout_fd = stdout_pipe[PIPE_READ];
     job->stderr_fd = stderr_pipe[PIPE_READ];
+    // Job output is read in pipe sized gulps, client commands are short
+    job->stdout_buffer.read_size = MAX_BUFSIZE;
+    job->stderr_buffer.read_size = MAX_BUFSIZE;
+    job->stdout_source.kind = EV_JOB_STDOUT;
+    job->stdout_source.owner = job;
+    job->stderr_source.kind = EV_JOB_STDERR;
+    job->stderr_source.owner = job;
 
     return job;
 }
 
-int add_job(JobList *job_list, JobNode* job) {
-    if (job_list->first == NULL) {
-        job_list->first = job;
-        job_list->count++;
+JobNode* start_job(char *path, char *const args[]) {
+    return launch_job(path, args, spawn_process);
+}
+
+JobNode* start_job_forked(char *path, char *const args[]) {
+    return launch_job(path, args, fork_process);
+}
+
+int start_jobs(char *path, char **argvs[], int count, JobNode *jobs[]) {
+    // Fail the whole batch at once rather than once per job
+    if (access(path, X_OK) < 0) {
+        perror(path);
+        for (int i = 0; i < count; i++) {
+            jobs[i] = NULL;
+        }
         return 0;
     }
-    
-    JobNode *last = job_list->first;
-    while(last->next != NULL) {
-        last = last->next;
+
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        jobs[i] = launch_job(path, argvs[i], spawn_process);
+        if (jobs[i] != NULL) {
+            started++;
+        }
     }
+    return started;
+}
+
+/* Returns the home slot of pid in an index of the given size.
+ */
+static int job_index_slot(int pid, int index_size) {
+    return ((unsigned int) pid * 2654435761u) & (index_size - 1);
+}
+
+/* Places job in the first free slot of its probe sequence.
+ */
+static void index_job(JobNode **index, int index_size, JobNode *job) {
+    int slot = job_index_slot(job->pid, index_size);
+    while (index[slot] != NULL) {
+        slot = (slot + 1) & (index_size - 1);
+    }
+    index[slot] = job;
+}
+
+/* Doubles the size of the pid index and reinserts every job.
+ * Returns 0 on success, -1 otherwise.
+ */
+static int grow_job_index(JobList *job_list) {
+    int index_size = job_list->index_size ? 
+                     job_list->index_size * 2 : JOB_INDEX_MIN;
+    JobNode **index = calloc(index_size, sizeof(JobNode *));
+    if (index == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (JobNode *job = job_list->first; job != NULL; job = job->next) {
+        index_job(index, index_size, job);
+    }
+
+    free(job_list->index);
+    job_list->index = index;
+    job_list->index_size = index_size;
+    return 0;
+}
+
+/* Removes job from the pid index. Entries after it in the same cluster are
+ * shifted back, so no tombstones are needed.
+ */
+static void unindex_job(JobList *job_list, JobNode *job) {
+    JobNode **index = job_list->index;
+    int mask = job_list->index_size - 1;
+
+    int hole = job_index_slot(job->pid, job_list->index_size);
+    while (index[hole] != job) {
+        hole = (hole + 1) & mask;
+    }
+    index[hole] = NULL;
+
+    for (int slot = (hole + 1) & mask; index[slot] != NULL; 
+            slot = (slot + 1) & mask) {
+        int home = job_index_slot(index[slot]->pid, job_list->index_size);
+        // Entries whose home lies cyclically in (hole, slot] must stay
+        if (((hole < slot) && (home <= hole || home > slot)) || 
+                ((hole > slot) && (home <= hole && home > slot))) {
+            index[hole] = index[slot];
+            index[slot] = NULL;
+            hole = slot;
+        }
+    }
+}
+
+int add_job(JobList *job_list, JobNode* job) {
+    if ((job_list->count + 1) * 2 > job_list->index_size && 
+            grow_job_index(job_list) < 0) {
+        return -1;
+    }
+    index_job(job_list->index, job_list->index_size, job);
+
+    job->next = NULL;
+    job->prev = job_list->last;
+    if (job_list->last == NULL) {
+        job_list->first = job;
+    } else {
+        job_list->last->next = job;
+    }
+    job_list->last = job;
 
-    last->next = job;
     job_list->count++;
     return 0;
 }
 
+JobNode* find_job(JobList *job_list, int pid) {
+    if (job_list->index_size == 0) {
+        return NULL;
+    }
+
+    int mask = job_list->index_size - 1;
+    for (int slot = job_index_slot(pid, job_list->index_size); 
+            job_list->index[slot] != NULL; slot = (slot + 1) & mask) {
+        if (job_list->index[slot]->pid == pid) {
+            return job_list->index[slot];
+        }
+    }
+    return NULL;
+}
+
+void unlink_job(JobList *job_list, JobNode *job) {
+    unindex_job(job_list, job);
+
+    if (job->prev == NULL) {
+        job_list->first = job->next;
+    } else {
+        job->prev->next = job->next;
+    }
+    if (job->next == NULL) {
+        job_list->last = job->prev;
+    } else {
+        job->next->prev = job->prev;
+    }
+    job->prev = NULL;
+    job->next = NULL;
+
+    job_list->count--;
+}
+
+int reserve_pools(int count) {
+    if (reserve_pool(&job_pool, count) < 0 || 
+            reserve_pool(&client_pool, count) < 0 || 
+            reserve_pool(&watcher_pool, count) < 0 ||
+            reserve_pool(&buffer_pool, 3 * count) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void empty_pools(void) {
+    empty_pool(&job_pool);
+    empty_pool(&client_pool);
+    empty_pool(&watcher_pool);
+    empty_pool(&buffer_pool);
+}
+
+Client* new_client(ClientTable *table, int fd) {
+    if (fd >= table->size) {
+        int size = table->size > 0 ? table->size : CLIENT_SLAB;
+        while (size <= fd) {
+            size *= 2;
+        }
+        Client **by_fd = realloc(table->by_fd, size * sizeof(Client *));
+        if (by_fd == NULL) {
+            return NULL;
+        }
+        memset(by_fd + table->size, 0, 
+               (size - table->size) * sizeof(Client *));
+        table->by_fd = by_fd;
+        table->size = size;
+    }
+
+    Client *client = pool_alloc(&client_pool);
+    if (client == NULL) {
+        return NULL;
+    }
+    memset(client, 0, sizeof(Client));
+    client->socket_fd = fd;
+    client->raw_pipe[0] = -1;
+    client->raw_pipe[1] = -1;
+    client->peer_shard = -1;
+    table->by_fd[fd] = client;
+    table->count++;
+    return client;
+}
+
+Client* find_client(ClientTable *table, int fd) {
+    if (fd < 0 || fd >= table->size) {
+        return NULL;
+    }
+    return table->by_fd[fd];
+}
+
+void free_client(ClientTable *table, Client *client) {
+    if (client->socket_fd >= 0 && client->socket_fd < table->size) {
+        table->by_fd[client->socket_fd] = NULL;
+    }
+    pool_free(&client_pool, client);
+    table->count--;
+}
+
+void empty_client_table(ClientTable *table) {
+    free(table->by_fd);
+    memset(table, 0, sizeof(ClientTable));
+}
+
+// Names of the flow policies, in FlowPolicy order
+static const char *flow_policy_names[] = {"block", "drop", "kill"};
+
+const char* flow_policy_name(FlowPolicy policy) {
+    return flow_policy_names[policy];
+}
+
+int parse_flow_policy(const char *name) {
+    for (int i = 0; i < (int) (sizeof(flow_policy_names) / sizeof(char *)); 
+            i++) {
+        if (strcmp(name, flow_policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 JobCommand get_job_command(char* str) {
     if (strlen(str) == 0) {
         return CMD_INVALID;
@@ -99,31 +411,176 @@ JobCommand get_job_command(char* str) {
     if (strncmp(command, "exit", BUFSIZE + 1) == 0) {
         return CMD_EXIT;
     }
+    if (strncmp(command, "maxjobs", BUFSIZE + 1) == 0) {
+        return CMD_MAXJOBS;
+    }
+    if (strncmp(command, "stats", BUFSIZE + 1) == 0) {
+        return CMD_STATS;
+    }
+    if (strncmp(command, "tail", BUFSIZE + 1) == 0) {
+        return CMD_TAIL;
+    }
+    if (strncmp(command, "cat", BUFSIZE + 1) == 0) {
+        return CMD_CAT;
+    }
+    if (strncmp(command, "reap", BUFSIZE + 1) == 0) {
+        return CMD_REAP;
+    }
+    if (strncmp(command, "binary", BUFSIZE + 1) == 0) {
+        return CMD_BINARY;
+    }
+    if (strncmp(command, "runmany", BUFSIZE + 1) == 0) {
+        return CMD_RUNMANY;
+    }
+    if (strncmp(command, "maxclients", BUFSIZE + 1) == 0) {
+        return CMD_MAXCLIENTS;
+    }
+    if (strncmp(command, "flow", BUFSIZE + 1) == 0) {
+        return CMD_FLOW;
+    }
+    if (strncmp(command, "watch-raw", BUFSIZE + 1) == 0) {
+        return CMD_WATCHRAW;
+    }
+    if (strncmp(command, "cork", BUFSIZE + 1) == 0) {
+        return CMD_CORK;
+    }
 
     return CMD_INVALID;
 }
 
 int kill_job(JobList *job_list, int pid) {
-    for (JobNode *job = job_list->first; job != NULL; job = job->next) {
-        if (job->pid == pid) {
-            if (kill(pid, SIGKILL) < 0) {
-                return -1;
-            }
-            return 0;
-        }
+    if (find_job(job_list, pid) == NULL) {
+        return 1;
     }
-    return 1;
+    if (kill(pid, SIGKILL) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int remove_job(JobList *job_list, int pid) {
+    JobNode *job = find_job(job_list, pid);
+    if (job == NULL) {
+        return -1;
+    }
+
+    unlink_job(job_list, job);
+    delete_job_node(job);
+    return 0;
 }
 
 int mark_job_dead(JobList *job_list, int pid, int stat) {
-    for (JobNode *job = job_list->first; job != NULL; job = job->next) {
-        if (job->pid == pid) {
-            job->dead = 1;
-            job->wait_status = stat;
-            return 0;
+    JobNode *job = find_job(job_list, pid);
+    if (job == NULL) {
+        return -1;
+    }
+
+    job->dead = 1;
+    job->wait_status = stat;
+    return 0;
+}
+
+int enqueue_run(RunQueue *queue, char *path, char *const args[], 
+                int priority, Client *client) {
+    int argc = 0;
+    size_t strings_len = strlen(path) + 1;
+    while (args[argc] != NULL) {
+        strings_len += strlen(args[argc]) + 1;
+        argc++;
+    }
+
+    size_t args_len = (argc + 1) * sizeof(char *);
+    PendingRun *run = malloc(sizeof(PendingRun) + args_len + strings_len);
+    if (run == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    run->priority = priority;
+    run->client = client;
+    run->args = (char **) (run + 1);
+
+    char *strings = (char *) run->args + args_len;
+    run->path = strcpy(strings, path);
+    strings += strlen(path) + 1;
+    for (int i = 0; i < argc; i++) {
+        run->args[i] = strcpy(strings, args[i]);
+        strings += strlen(args[i]) + 1;
+    }
+    run->args[argc] = NULL;
+
+    // Walk back from the end past every run with a lower priority
+    int behind = 0;
+    PendingRun *before = queue->last;
+    while (before != NULL && before->priority < priority) {
+        before = before->prev;
+        behind++;
+    }
+
+    run->prev = before;
+    if (before == NULL) {
+        run->next = queue->first;
+        queue->first = run;
+    } else {
+        run->next = before->next;
+        before->next = run;
+    }
+    if (run->next == NULL) {
+        queue->last = run;
+    } else {
+        run->next->prev = run;
+    }
+    queue->count++;
+
+    return queue->count - behind;
+}
+
+/* Removes the given run from the given queue without freeing it.
+ */
+static void unlink_run(RunQueue *queue, PendingRun *run) {
+    if (run->prev == NULL) {
+        queue->first = run->next;
+    } else {
+        run->prev->next = run->next;
+    }
+    if (run->next == NULL) {
+        queue->last = run->prev;
+    } else {
+        run->next->prev = run->prev;
+    }
+    queue->count--;
+}
+
+PendingRun* dequeue_run(RunQueue *queue) {
+    PendingRun *run = queue->first;
+    if (run != NULL) {
+        unlink_run(queue, run);
+    }
+    return run;
+}
+
+int remove_client_runs(RunQueue *queue, Client *client) {
+    int removed = 0;
+    PendingRun *next;
+    for (PendingRun *run = queue->first; run != NULL; run = next) {
+        next = run->next;
+        if (run->client == client) {
+            unlink_run(queue, run);
+            delete_pending_run(run);
+            removed++;
         }
     }
-    return -1;
+    return removed;
+}
+
+void empty_run_queue(RunQueue *queue) {
+    PendingRun *run;
+    while ((run = dequeue_run(queue)) != NULL) {
+        delete_pending_run(run);
+    }
+}
+
+void delete_pending_run(PendingRun *run) {
+    free(run);
 }
 
 int empty_job_list(JobList *job_list) {
@@ -132,7 +589,11 @@ int empty_job_list(JobList *job_list) {
         next = job->next;
         delete_job_node(job);
     }
+    free(job_list->index);
     job_list->first = NULL;
+    job_list->last = NULL;
+    job_list->index = NULL;
+    job_list->index_size = 0;
     job_list->count = 0;
     return 0;
 } 
@@ -140,10 +601,14 @@ int empty_job_list(JobList *job_list) {
 int delete_job_node(JobNode *job) {
     close(job->stdout_fd);
     close(job->stderr_fd);
+    free_buffer(&(job->stdout_buffer));
+    free_buffer(&(job->stderr_buffer));
 
     empty_watcher_list(&(job->watcher_list));
+    empty_watcher_list(&(job->raw_watchers));
+    empty_scrollback(&(job->scrollback));
 
-    free(job);
+    pool_free(&job_pool, job);
     return 0;
 }
 
@@ -168,99 +633,276 @@ int kill_job_node(JobNode *job) {
     return 0;
 }
 
-int add_watcher(WatcherList *watchers, int client_fd) {
-    WatcherNode *watcher = malloc(sizeof(WatcherNode));
+int add_watcher(WatcherList *watchers, Client *client) {
+    WatcherNode *watcher = pool_alloc(&watcher_pool);
     if (watcher == NULL) {
         perror("malloc");
         return -1;
     }
 
-    watcher->client_fd = client_fd;
+    watcher->client = client;
+    watcher->list = watchers;
+    watcher->filter = NULL;
+    watcher->prev = NULL;
     watcher->next = watchers->first;
+    if (watchers->first != NULL) {
+        watchers->first->prev = watcher;
+    }
     watchers->first = watcher;
     watchers->count++;
 
+    watcher->client_prev = NULL;
+    watcher->client_next = client->watching;
+    if (client->watching != NULL) {
+        client->watching->client_prev = watcher;
+    }
+    client->watching = watcher;
+
     return 0;
 }
 
-int remove_watcher(WatcherList *watcher_list, int client_fd) {
-    WatcherNode **previous = &(watcher_list->first);
-    for (WatcherNode *watcher = watcher_list->first; watcher != NULL; watcher = watcher->next) {
-        if (watcher->client_fd == client_fd) {
-            *previous = watcher->next;
-            delete_watcher_node(watcher);
-            watcher_list->count--;
-            return 0;
+/* Returns the node linking the given client to the given list of watchers,
+ * or NULL if it is not watching. Only the client's own list is searched.
+ */
+static WatcherNode *find_watcher(WatcherList *watcher_list, Client *client) {
+    for (WatcherNode *watcher = client->watching; watcher != NULL; 
+            watcher = watcher->client_next) {
+        if (watcher->list == watcher_list) {
+            return watcher;
         }
-        previous = &(watcher->next);
     }
-    
-    return 1;
+    return NULL;
 }
 
-void remove_client_from_all_watchers(JobList *job_list, int client_fd) {
-    for (JobNode *job = job_list->first; job != NULL; job = job->next) {
-        remove_watcher(&(job->watcher_list), client_fd);
+int remove_watcher(WatcherList *watcher_list, Client *client) {
+    WatcherNode *watcher = find_watcher(watcher_list, client);
+    if (watcher == NULL) {
+        return 1;
     }
+    delete_watcher_node(watcher);
+    return 0;
 }
 
-int add_watcher_by_pid(JobList *job_list, int pid, int client_fd) {
-    for (JobNode *job = job_list->first; job != NULL; job = job->next) {
-        if (job->pid == pid) {
-            return add_watcher(&(job->watcher_list), client_fd);
+int has_watcher(WatcherList *watcher_list, Client *client) {
+    return find_watcher(watcher_list, client) != NULL;
+}
+
+int add_to_scrollback(Scrollback *scrollback, OutChunk *chunk, int *ends, 
+                      int count) {
+    ScrollbackBatch *batch = malloc(sizeof(ScrollbackBatch) + 
+                                    count * sizeof(int));
+    if (batch == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    batch->chunk = chunk;
+    chunk->refs++;
+    batch->next = NULL;
+    batch->count = count;
+    memcpy(batch->ends, ends, count * sizeof(int));
+
+    if (scrollback->newest == NULL) {
+        scrollback->oldest = batch;
+    } else {
+        scrollback->newest->next = batch;
+    }
+    scrollback->newest = batch;
+    scrollback->count += count;
+    scrollback->bytes += ends[count - 1];
+
+    while (scrollback->bytes > scrollback_bytes) {
+        ScrollbackBatch *oldest = scrollback->oldest;
+        int skipped = scrollback->skipped;
+        scrollback->bytes -= oldest->ends[skipped] - 
+                             scrollback_line_start(oldest, skipped);
+        scrollback->count--;
+        scrollback->first++;
+        if (++scrollback->skipped < oldest->count) {
+            continue;
         }
+        scrollback->oldest = oldest->next;
+        if (scrollback->oldest == NULL) {
+            scrollback->newest = NULL;
+        }
+        scrollback->skipped = 0;
+        release_chunk(oldest->chunk);
+        free(oldest);
+    }
+    return 0;
+}
+
+ScrollbackBatch* find_scrollback_line(Scrollback *scrollback, long long line, 
+                                      int *index) {
+    ScrollbackBatch *batch = scrollback->oldest;
+    long long first = scrollback->first;
+    *index = scrollback->skipped;
+    while (batch != NULL && line >= first + batch->count - *index) {
+        first += batch->count - *index;
+        batch = batch->next;
+        *index = 0;
     }
-    return 1;
+    if (batch != NULL && line > first) {
+        *index += line - first;
+    }
+    return batch;
+}
+
+int scrollback_line_start(ScrollbackBatch *batch, int index) {
+    return index > 0 ? batch->ends[index - 1] : 0;
+}
+
+void empty_scrollback(Scrollback *scrollback) {
+    while (scrollback->oldest != NULL) {
+        ScrollbackBatch *batch = scrollback->oldest;
+        scrollback->oldest = batch->next;
+        release_chunk(batch->chunk);
+        free(batch);
+    }
+    memset(scrollback, 0, sizeof(Scrollback));
+}
+
+void remove_client_from_all_watchers(Client *client) {
+    while (client->watching != NULL) {
+        delete_watcher_node(client->watching);
+    }
+}
+
+int add_watcher_by_pid(JobList *job_list, int pid, Client *client) {
+    JobNode *job = find_job(job_list, pid);
+    if (job == NULL) {
+        return 1;
+    }
+    return add_watcher(&(job->watcher_list), client);
 } 
 
-int remove_watcher_by_pid(JobList *job_list, int pid, int client_fd) {
-    for (JobNode *job = job_list->first; job != NULL; job = job->next) {
-        if (job->pid == pid) {
-            int result = remove_watcher(&(job->watcher_list), client_fd);
-            return result ? 2 : 0;
-        }
+int set_watcher_filter(WatcherList *watchers, Client *client, 
+                       const char *pattern, int regex) {
+    WatcherNode *watcher = find_watcher(watchers, client);
+    if (watcher == NULL) {
+        return 1;
+    }
+    LineFilter *filter = get_line_filter(&(watchers->filters), pattern, regex);
+    if (filter == NULL) {
+        return -1;
+    }
+    if (watcher->filter != NULL) {
+        put_line_filter(&(watchers->filters), watcher->filter);
+    }
+    watcher->filter = filter;
+    return 0;
+}
+
+int remove_watcher_by_pid(JobList *job_list, int pid, Client *client) {
+    JobNode *job = find_job(job_list, pid);
+    if (job == NULL) {
+        return 1;
     }
-    return 1;
+    int result = remove_watcher(&(job->watcher_list), client);
+    return result ? 2 : 0;
 }
 
 int empty_watcher_list(WatcherList *watchers) {
-    WatcherNode *next;
-    for (WatcherNode *watcher = watchers->first; watcher != NULL; watcher = next) {
-        next = watcher->next;
-        free(watcher);
+    while (watchers->first != NULL) {
+        delete_watcher_node(watchers->first);
     }
-    watchers->first = NULL;
-    watchers->count = 0;
     return 0;
 }
 
 int delete_watcher_node(WatcherNode *watcher) {
-    free(watcher);
+    WatcherList *watchers = watcher->list;
+    if (watcher->prev != NULL) {
+        watcher->prev->next = watcher->next;
+    } else {
+        watchers->first = watcher->next;
+    }
+    if (watcher->next != NULL) {
+        watcher->next->prev = watcher->prev;
+    }
+    watchers->count--;
+
+    Client *client = watcher->client;
+    if (watcher->client_prev != NULL) {
+        watcher->client_prev->client_next = watcher->client_next;
+    } else {
+        client->watching = watcher->client_next;
+    }
+    if (watcher->client_next != NULL) {
+        watcher->client_next->client_prev = watcher->client_prev;
+    }
+
+    if (watcher->filter != NULL) {
+        put_line_filter(&(watchers->filters), watcher->filter);
+    }
+    pool_free(&watcher_pool, watcher);
     return 0;
 }
 
 int find_network_newline(const char *buf, int n) {
-    for (int i = 0; i < n - 1; i++) {
-        if (buf[i] == '\r' && buf[i + 1] == '\n') {
-            return i + 2;
+    const char *start = buf;
+    const char *newline;
+    while ((newline = memchr(start, '\n', buf + n - start)) != NULL) {
+        if (newline > buf && newline[-1] == '\r') {
+            return newline - buf + 1;
         }
+        start = newline + 1;
     }
     
     return -1;
 }
 
 int find_unix_newline(const char *buf, int n) {
-    for (int i = 0; i < n; i++) {
-        if (buf[i] == '\n') {
-            return i + 1;
-        }
+    const char *newline = memchr(buf, '\n', n);
+    if (newline == NULL) {
+        return -1;
     }
     
-    return -1;
+    return newline - buf + 1;
+}
+
+/* Doubles the size of a buffer, or allocates it, until it holds at least
+ * min bytes, up to MAX_BUFSIZE.
+ * Returns 0 on success, -1 otherwise.
+ */
+static int grow_buffer(Buffer *buf, int min) {
+    int size = buf->size ? buf->size * 2 : BUFSIZE;
+    while (size < min) {
+        size *= 2;
+    }
+    if (size > MAX_BUFSIZE) {
+        size = MAX_BUFSIZE;
+    }
+
+    // Buffers start out in buffer_pool, and move to the heap to grow
+    char *grown;
+    if (size == BUFSIZE) {
+        grown = pool_alloc(&buffer_pool);
+    } else if (buf->size == BUFSIZE) {
+        if ((grown = malloc(size + 1)) != NULL) {
+            memcpy(grown, buf->buf, buf->inbuf);
+            pool_free(&buffer_pool, buf->buf);
+        }
+    } else {
+        grown = realloc(buf->buf, size + 1);
+    }
+    if (grown == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    buf->buf = grown;
+    buf->size = size;
+    return 0;
 }
 
 int read_to_buf(int fd, Buffer *buf) {
-    int nbytes = read(fd, buf->buf + buf->inbuf, BUFSIZE - buf->inbuf);
+    if (buf->size < buf->read_size && grow_buffer(buf, buf->read_size) < 0) {
+        return -1;
+    }
+    if (buf->inbuf == buf->size && buf->size < MAX_BUFSIZE && 
+            grow_buffer(buf, 0) < 0) {
+        return -1;
+    }
+
+    int nbytes = read(fd, buf->buf + buf->inbuf, buf->size - buf->inbuf);
     if (nbytes == -1) {
         return -1;
     }
@@ -271,6 +913,9 @@ int read_to_buf(int fd, Buffer *buf) {
 }
 
 char* get_next_msg(Buffer* buf, int* len, NewlineType ntype) {
+    if (buf->buf == NULL) {
+        return NULL;
+    }
     char *start = buf->buf + buf->consumed;
 
     int length;
@@ -294,13 +939,114 @@ char* get_next_msg(Buffer* buf, int* len, NewlineType ntype) {
     return start;
 }
 
+char* get_next_lines(Buffer *buf, int *ends, int *count) {
+    if (buf->buf == NULL) {
+        return NULL;
+    }
+    char *start = buf->buf + buf->consumed;
+
+    *count = find_newlines(start, buf->inbuf - buf->consumed, ends, *count);
+    if (*count == 0) {
+        return NULL;
+    }
+
+    buf->consumed += ends[*count - 1];
+    return start;
+}
+
+char* take_overlong_msg(Buffer *buf, int *len) {
+    if (!is_buffer_full(buf) || buf->consumed != 0) {
+        return NULL;
+    }
+
+    char *start = buf->buf + buf->consumed;
+    *len = buf->inbuf - buf->consumed;
+    start[*len] = '\0';
+    buf->consumed = buf->inbuf;
+    return start;
+}
+
+char* get_next_frame(Buffer *buf, Frame *frame) {
+    frame->len = 0;
+    int available = buf->inbuf - buf->consumed;
+    if (buf->buf == NULL || available < FRAME_HEADER) {
+        return NULL;
+    }
+    unsigned char *header = (unsigned char *)buf->buf + buf->consumed;
+
+    uint32_t len;
+    uint32_t id;
+    memcpy(&len, header, sizeof(len));
+    memcpy(&id, header + 5, sizeof(id));
+    len = ntohl(len);
+    if (len > MAX_BUFSIZE - FRAME_HEADER) {
+        frame->len = -1;
+        return NULL;
+    }
+    if (available < FRAME_HEADER + (int)len) {
+        return NULL;
+    }
+
+    frame->type = header[4];
+    frame->id = ntohl(id);
+    frame->len = len;
+    frame->payload = (char *)header + FRAME_HEADER;
+    buf->consumed += FRAME_HEADER + len;
+    return (char *)frame->payload;
+}
+
+void write_frame_header(char *buf, Frame *frame) {
+    uint32_t payload_len = htonl(frame->len);
+    uint32_t id = htonl(frame->id);
+    memcpy(buf, &payload_len, sizeof(payload_len));
+    buf[4] = frame->type;
+    memcpy(buf + 5, &id, sizeof(id));
+}
+
+OutChunk* new_frame(Frame *frame) {
+    int len = FRAME_HEADER;
+    if (frame->payload != NULL) {
+        len += frame->len;
+    }
+    OutChunk *chunk = alloc_chunk(len);
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    write_frame_header(chunk->data, frame);
+    if (frame->payload != NULL) {
+        memcpy(chunk->data + FRAME_HEADER, frame->payload, frame->len);
+    }
+    return chunk;
+}
+
 void shift_buffer(Buffer *buf) {
     int chars_left = buf->inbuf - buf->consumed;
-    memmove(buf->buf, buf->buf + buf->consumed, chars_left);
+    if (chars_left == 0 && buf->size > BUFSIZE && buf->read_size == 0) {
+        // Give back what a long message made the buffer grow to
+        free_buffer(buf);
+        return;
+    }
+
+    if (buf->consumed > 0) {
+        memmove(buf->buf, buf->buf + buf->consumed, chars_left);
+    }
     buf->inbuf = chars_left;
     buf->consumed = 0;
 }
 
 int is_buffer_full(Buffer *buf) {
-    return buf->inbuf == BUFSIZE;
+    return buf->inbuf == buf->size && buf->size >= MAX_BUFSIZE;
+}
+
+void free_buffer(Buffer *buf) {
+    if (buf->size == BUFSIZE) {
+        pool_free(&buffer_pool, buf->buf);
+    } else {
+        free(buf->buf);
+    }
+    buf->buf = NULL;
+    buf->size = 0;
+    buf->consumed = 0;
+    buf->inbuf = 0;
 }
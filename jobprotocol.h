@@ -1,6 +1,11 @@
 #ifndef __JOB_PROTOCOL_H__
 #define __JOB_PROTOCOL_H__
 
+#include "outqueue.h"
+#include "journal.h"
+#include "pool.h"
+#include "linefilter.h"
+
 #ifndef PORT
   #define PORT 55555
 #endif
@@ -9,80 +14,395 @@
     #define MAX_JOBS 32
 #endif
 
-// No paths or lines may be larger than the BUFSIZE below
+// Bytes of recent output each job keeps for watchers that join late,
+// unless the server is given another budget with -b
+#ifndef SCROLLBACK_BYTES
+    #define SCROLLBACK_BYTES (64 * 1024)
+#endif
+
+// Most run requests that may wait for a free job slot at once
+#ifndef MAX_PENDING_RUNS
+    #define MAX_PENDING_RUNS 256
+#endif
+
+// Most clients that may be connected at once, changed at runtime with -c
+// or maxclients
+#ifndef MAX_CLIENTS
+    #define MAX_CLIENTS 1024
+#endif
+
+// Jobs, clients, watcher nodes and small input buffers are allocated from
+// pools this many at a time
+#ifndef JOB_SLAB
+    #define JOB_SLAB 32
+#endif
+#ifndef CLIENT_SLAB
+    #define CLIENT_SLAB 64
+#endif
+#ifndef WATCHER_SLAB
+    #define WATCHER_SLAB 256
+#endif
+#ifndef BUFFER_SLAB
+    #define BUFFER_SLAB 64
+#endif
+
+// Clients with more than this many bytes queued for them are disconnected,
+// unless the server is given another limit with -w
+#ifndef CLIENT_HIGH_WATER
+    #define CLIENT_HIGH_WATER (256 * 1024)
+#endif
+
+// A job whose watchers all have more than WATCHER_HIGH_WATER bytes queued
+// is throttled as its flow policy says, until one of them is back down to
+// WATCHER_LOW_WATER
+#ifndef WATCHER_HIGH_WATER
+    #define WATCHER_HIGH_WATER (128 * 1024)
+#endif
+#ifndef WATCHER_LOW_WATER
+    #define WATCHER_LOW_WATER (32 * 1024)
+#endif
+
+// Output queued for a client during a loop turn is written at the end of
+// the turn, or as soon as this many bytes are queued
+#ifndef COALESCE_BYTES
+    #define COALESCE_BYTES (64 * 1024)
+#endif
+
+// Longest a client may have its output held back for with cork
+#ifndef MAX_CORK_MS
+    #define MAX_CORK_MS 1000
+#endif
+
+// Size asked for the pipe that holds a raw watcher's output, see watch-raw
+#ifndef RAW_PIPE_SIZE
+    #define RAW_PIPE_SIZE (1024 * 1024)
+#endif
+
+/* What happens to a job that outputs faster than its watchers take it in:
+ * FLOW_BLOCK stops reading its pipes, so it blocks once they fill up,
+ * FLOW_DROP drops the oldest output still queued for its watchers, and
+ * FLOW_KILL kills it.
+ */
+typedef enum {FLOW_BLOCK, FLOW_DROP, FLOW_KILL} FlowPolicy;
+
+// No paths or server messages may be larger than the BUFSIZE below. Input
+// buffers start out this large and grow up to MAX_BUFSIZE.
 #define BUFSIZE 256
 
+// Lines from jobs longer than this are split, longer commands are dropped
+#ifndef MAX_BUFSIZE
+    #define MAX_BUFSIZE (64 * 1024)
+#endif
+
 #define CMD_INVALID -1
-typedef enum {CMD_LISTJOBS, CMD_RUNJOB, CMD_KILLJOB, CMD_WATCHJOB, CMD_EXIT} JobCommand;
-static const int n_job_commands = 5;
+typedef enum {CMD_LISTJOBS, CMD_RUNJOB, CMD_KILLJOB, CMD_WATCHJOB, CMD_EXIT, CMD_MAXJOBS, CMD_STATS, CMD_TAIL, CMD_CAT, CMD_REAP, CMD_BINARY, CMD_RUNMANY, CMD_MAXCLIENTS, CMD_FLOW, CMD_WATCHRAW, CMD_CORK} JobCommand;
+static const int n_job_commands = 16;
 // See here for explanation of enums in C: https://www.geeksforgeeks.org/enumeration-enum-c/
 
 typedef enum {NEWLINE_CRLF, NEWLINE_LF} NewlineType;
 
+/* After the binary command, everything a client sends and receives is
+ * framed. A frame is a 32 bit payload length, a type byte and a 32 bit id,
+ * all in network byte order, followed by the payload.
+ * Clients send commands as FRAME_COMMAND frames, with any id they choose.
+ * Every message a command is answered with comes in a FRAME_REPLY frame
+ * with the id of the command, and a FRAME_DONE frame ends the answer.
+ * Output of a watched job comes in FRAME_STDOUT and FRAME_STDERR frames
+ * with the job's pid as id and a single line without newline as payload,
+ * and its exit in a FRAME_EXIT frame. Replayed and journaled output comes
+ * in FRAME_OUTPUT frames, holding lines as text clients receive them.
+ */
+#define FRAME_HEADER 9
+typedef enum {FRAME_COMMAND = 1, FRAME_REPLY, FRAME_DONE, FRAME_STDOUT, 
+              FRAME_STDERR, FRAME_EXIT, FRAME_OUTPUT} FrameType;
+
+struct frame {
+	int type;
+	unsigned int id;
+	const char *payload;
+	int len;
+};
+typedef struct frame Frame;
+
 #define PIPE_READ 0
 #define PIPE_WRITE 1
 
+// Initial number of slots in a job list's pid index, must be a power of 2
+#define JOB_INDEX_MIN 16
+
+/* Input buffers are only allocated once something is read into them, grow
+ * geometrically while a message does not fit, and are freed again whenever
+ * they are emptied after having grown, so their memory follows the traffic.
+ * A buffer with a read_size is grown to that size before it is read into,
+ * and keeps it until it is freed, so a single read can take in a whole
+ * pipe's worth of job output.
+ * One byte past size is always allocated, so a message can be terminated.
+ */
 struct job_buffer {
-	char buf[BUFSIZE];
+	char *buf;
+	int size;
 	int consumed;
 	int inbuf;
+	int read_size;
 };
 typedef struct job_buffer Buffer;
 
+/* Kinds of file descriptors registered with the event loop. Each registered
+ * fd carries a pointer to an EventSource, so a ready fd can be dispatched
+ * straight to its client or job without searching for it.
+ */
+typedef enum {EV_LISTEN, EV_SIGNAL, EV_CLIENT, EV_JOB_STDOUT, EV_JOB_STDERR,
+              EV_LOG, EV_URING} EventKind;
+
+struct event_source {
+	EventKind kind;
+	void *owner;
+};
+typedef struct event_source EventSource;
+
 struct client {
 	int socket_fd;
 	struct job_buffer buffer;
+	int skip_msg;
+	int binary;
+	unsigned int request_id;
+	struct event_source source;
+	struct out_queue out_queue;
+	int events;
+	int closing;
+	long long bytes_sent;
+	struct client *next_closing;
+	struct watcher_node *watching;
+	int raw_pipe[2];
+	int raw_pending;
+	int peer_shard;
+	int forwarded;
+	int skip_bytes;
+	int sending;
+	int send_scheduled;
+	struct client *next_sending;
+	struct client *prev_sending;
+	int cork_ms;
+	long long cork_deadline;
 };
 typedef struct client Client;
 
+/* Connected clients, indexed by socket fd. Clients come from client_pool,
+ * whose slots never move while the table is in use, so pointers to clients
+ * stay valid. The index grows as fds get larger.
+ */
+struct client_table {
+	struct client **by_fd;
+	int size;
+	int count;
+};
+typedef struct client_table ClientTable;
+
+/* A client watching a job. Every node is linked into both the job's list
+ * of watchers and the client's list of the jobs it watches, in both
+ * directions, so it can be unlinked from either side in constant time.
+ * Looking one up, or dropping a client, only walks that client's list.
+ * A watcher with a filter is only sent the lines of output that match it.
+ */
 struct watcher_node {
-	int client_fd;
+	struct client *client;
+	struct watcher_list *list;
+	struct line_filter *filter;
+	struct watcher_node *prev;
 	struct watcher_node *next;
+	struct watcher_node *client_prev;
+	struct watcher_node *client_next;
 };
 typedef struct watcher_node WatcherNode;
 
 struct watcher_list {
 	struct watcher_node* first;
 	int count;
+	struct line_filter *filters;
 };
 typedef struct watcher_list WatcherList;
 
+/* The most recent lines a job output, as they were sent to its watchers,
+ * kept until they take more than scrollback_bytes. Lines are kept in the
+ * batches they were announced in, each holding the chunk its text was sent
+ * to watchers in and where every line of it ends, so keeping lines
+ * allocates and copies nothing per line. Lines are dropped from the front
+ * of the oldest batch, skipped, and its chunk is released once all of
+ * them are. Lines are numbered from 0 in the order the job output them.
+ */
+struct scrollback_batch {
+	struct out_chunk *chunk;
+	struct scrollback_batch *next;
+	int count;
+	int ends[];
+};
+typedef struct scrollback_batch ScrollbackBatch;
+
+struct scrollback {
+	struct scrollback_batch *oldest;
+	struct scrollback_batch *newest;
+	int skipped;
+	int bytes;
+	int count;
+	long long first;
+};
+typedef struct scrollback Scrollback;
+
 struct job_node {
 	int pid;
 	int stdout_fd;
 	int stderr_fd;
 	int dead;
 	int wait_status;
+	long long started_us;
+	long long bytes_read;
+	long long lines_read;
+	FlowPolicy flow;
+	int paused;
+	int raw_waiting;
 	struct job_buffer stdout_buffer;
 	struct job_buffer stderr_buffer;
+	struct event_source stdout_source;
+	struct event_source stderr_source;
 	struct watcher_list watcher_list;
+	struct watcher_list raw_watchers;
+	struct scrollback scrollback;
+	struct journal *journal;
+	struct job_node* prev;
 	struct job_node* next;
 };
 typedef struct job_node JobNode;
 
-
+/* Jobs are kept in a doubly linked list in the order they were added, and
+ * indexed by pid in an open-addressing (linear probing) hash table, so
+ * lookups, inserts and removals take constant time.
+ */
 struct job_list {
 	struct job_node* first;
+	struct job_node* last;
+	struct job_node** index;
+	int index_size;
     int count;
 };
 typedef struct job_list JobList;
 
+/* A run request waiting for a free job slot. Its path and arguments are
+ * copied into the same allocation as the node.
+ */
+struct pending_run {
+	int priority;
+	struct client *client;
+	char *path;
+	char **args;
+	struct pending_run *prev;
+	struct pending_run *next;
+};
+typedef struct pending_run PendingRun;
+
+/* Pending runs are ordered by descending priority, and by arrival within
+ * the same priority.
+ */
+struct run_queue {
+	struct pending_run *first;
+	struct pending_run *last;
+	int count;
+};
+typedef struct run_queue RunQueue;
+
+/* Every job node, client and watcher node, and every input buffer of
+ * BUFSIZE bytes, comes from one of these pools. Buffers only leave
+ * buffer_pool when they grow larger.
+ */
+extern Pool job_pool;
+extern Pool client_pool;
+extern Pool watcher_pool;
+extern Pool buffer_pool;
+
+/* Bytes of output every job keeps in its scrollback, SCROLLBACK_BYTES
+ * unless changed before jobs start.
+ */
+extern int scrollback_bytes;
+
+/* Allocates room up front for count jobs, count clients and count watcher
+ * nodes, along with the input buffers of the jobs and clients.
+ * Returns 0 on success, -1 otherwise.
+ */
+int reserve_pools(int);
+
+/* Frees every pool, along with whatever is still allocated from them.
+ */
+void empty_pools(void);
+
+/* Takes a free slot in the given client table for a client connected on
+ * the given socket, and returns it zeroed out but for its socket_fd, its
+ * raw_pipe, which is not open yet, and its peer_shard, which is -1 for
+ * clients that are not links to another shard.
+ * Returns NULL if the table could not grow.
+ */
+Client* new_client(ClientTable*, int);
+
+/* Returns the client connected on the given socket, or NULL if there is
+ * none.
+ */
+Client* find_client(ClientTable*, int);
+
+/* Gives a client's slot back to the given client table. The client's socket
+ * and memory must have been released already.
+ */
+void free_client(ClientTable*, Client*);
+
+/* Frees the index of a client table and resets it. The clients
+ * themselves go with client_pool.
+ */
+void empty_client_table(ClientTable*);
+
+/* Returns the name of a flow policy, or parses one. parse_flow_policy()
+ * returns -1 for an unknown name.
+ */
+const char* flow_policy_name(FlowPolicy);
+int parse_flow_policy(const char *);
+
 /* Returns the specific JobCommand enum value related to the
  * input str. Returns CMD_INVALID if no match is found.
  */
 JobCommand get_job_command(char*);
 
-/* Forks the process and launches a job executable. Allocates a
+/* Launches a job executable with posix_spawn(). Allocates a
  * JobNode containing PID, stdout and stderr pipes, and returns
- * it. Returns NULL if the JobNode could not be created.
+ * it. Returns NULL if the JobNode could not be created or the
+ * executable could not be run.
+ * The pipes are non-blocking, and the job starts with no signals
+ * blocked or ignored.
  */
 JobNode* start_job(char *, char * const[]);
 
-/* Adds the given job to the given list of jobs.
+/* Starts count jobs running path, the ith of them with the arguments in
+ * argvs[i], and stores them in jobs, or NULL for those that could not be
+ * started. The jobs are launched one after the other, sharing the work that
+ * does not depend on their arguments.
+ * Returns the number of jobs started.
+ */
+int start_jobs(char *, char **[], int, JobNode *[]);
+
+/* Same as start_job(), but forks the whole server before calling execv().
+ * Kept to compare launch latency against, see spawnbench.c.
+ */
+JobNode* start_job_forked(char *, char * const[]);
+
+/* Adds the given job to the end of the given list of jobs.
  * Returns 0 on success, -1 otherwise.
  */
 int add_job(JobList*, JobNode*);
 
+/* Returns the job with the given pid in the given job list, or NULL if it
+ * is not found.
+ */
+JobNode* find_job(JobList*, int);
+
+/* Removes the given job from the given job list without freeing it.
+ */
+void unlink_job(JobList*, JobNode*);
+
 /* Sends SIGKILL to the given job_pid only if it is part of the given
  * job list. Returns 0 if successful, 1 if it is not found, or -1 if
  * the kill command failed.
@@ -99,6 +419,30 @@ int remove_job(JobList*, int);
  */
 int mark_job_dead(JobList*, int, int);
 
+/* Copies a run request into the given queue, behind every request with the
+ * same or a higher priority. Returns its 1-based position in the queue, or
+ * -1 if it could not be allocated.
+ */
+int enqueue_run(RunQueue*, char *, char * const[], int, Client*);
+
+/* Removes the first run from the given queue and returns it, or returns
+ * NULL if the queue is empty. The caller frees it with delete_pending_run.
+ */
+PendingRun* dequeue_run(RunQueue*);
+
+/* Removes every run requested by the given client from the given queue.
+ * Returns the number of runs removed.
+ */
+int remove_client_runs(RunQueue*, Client*);
+
+/* Frees all memory held by a run queue and resets it.
+ */
+void empty_run_queue(RunQueue*);
+
+/* Frees all memory held by a pending run.
+ */
+void delete_pending_run(PendingRun*);
+
 /* Frees all memory held by a job list and resets it.
  * Returns 0 on success, -1 otherwise.
  */
@@ -120,35 +464,71 @@ int kill_job_node(JobNode *);
 /* Adds the given watcher to the given list of watchers.
  * Returns 0 on success, -1 otherwise.
  */
-int add_watcher(WatcherList*, int);
+int add_watcher(WatcherList*, Client*);
 
 /* Removes a watcher from the given watcher list and frees it from memory.
  * Returns 0 if successful, or 1 if not found.
  */
-int remove_watcher(WatcherList*, int);
+int remove_watcher(WatcherList*, Client*);
+
+/* Removes a client from every watcher list it is in.
+ */
+void remove_client_from_all_watchers(Client*);
+
+/* Returns 1 if the given client is in the given list of watchers, 0
+ * otherwise.
+ */
+int has_watcher(WatcherList*, Client*);
 
-/* Removes a client from every watcher list in the given job list.
+/* Keeps count lines in the given scrollback, line i ending ends[i] bytes
+ * into chunk, and drops its oldest lines while it holds more than
+ * scrollback_bytes.
+ * Returns 0 on success, -1 otherwise.
  */
-void remove_client_from_all_watchers(JobList*, int);
+int add_to_scrollback(Scrollback*, OutChunk*, int*, int);
+
+/* Returns the batch holding the given line number in the given scrollback,
+ * or its oldest line if that line was dropped, and sets *index to the
+ * line's index in the batch. Returns NULL if the line has not been output
+ * yet.
+ */
+ScrollbackBatch* find_scrollback_line(Scrollback*, long long, int*);
+
+/* Returns the offset in its batch's chunk at which line index starts.
+ */
+int scrollback_line_start(ScrollbackBatch*, int);
+
+/* Releases every line kept in a scrollback and resets it.
+ */
+void empty_scrollback(Scrollback*);
 
 /* Adds the given watcher to a given job pid.
  * Returns 0 on success, 1 if job was not found, or -1 if watcher could not
  * be allocated.
  */
-int add_watcher_by_pid(JobList*, int, int);
+int add_watcher_by_pid(JobList*, int, Client*);
+
+/* Only sends the given client the lines of output that match the given
+ * pattern, a POSIX extended regex if the flag is set, from the given list
+ * of watchers it is in. Watchers with the same pattern share its filter.
+ * Returns 0 on success, 1 if the client is not watching, or -1 if the
+ * pattern is not a valid regex.
+ */
+int set_watcher_filter(WatcherList*, Client*, const char *, int);
 
 /* Removes the given watcher from the list of a given job pid.
- * Returns 0 on success, 1 if job was not found, or 2 if client_fd could
+ * Returns 0 on success, 1 if job was not found, or 2 if the client could
  * not be found in list of watchers.
  */
-int remove_watcher_by_pid(JobList*, int, int);
+int remove_watcher_by_pid(JobList*, int, Client*);
 
 /* Frees all memory held by a watcher list and resets it.
  * Returns 0 on success, -1 otherwise.
  */
 int empty_watcher_list(WatcherList *);
 
-/* Frees all memory held by a watcher node and its children.
+/* Unlinks a watcher node from the job and the client it links, and frees
+ * it.
  */
 int delete_watcher_node(WatcherNode *);
 
@@ -172,12 +552,14 @@ int convert_to_crlf(char*, int);
 int find_network_newline(const char *, int);
 
 /* Search the first n characters of buf for an unix newline (\n).
- * Return one plus the index of the '\n' of the first network newline,
- * or -1 if no network newline is found.
+ * Return one plus the index of the first '\n', or -1 if no unix newline
+ * is found.
  */
 int find_unix_newline(const char *, int);
 
-/* Read as much as possible from file descriptor fd into the given buffer.
+/* Read as much as possible from file descriptor fd into the given buffer,
+ * growing it first if it is full and still smaller than MAX_BUFSIZE, or
+ * smaller than its read_size.
  * Returns number of bytes read, or 0 if fd closed, or -1 on error.
  */
 int read_to_buf(int, Buffer*);
@@ -188,13 +570,49 @@ int read_to_buf(int, Buffer*);
  */
 char* get_next_msg(Buffer*, int*, NewlineType);
 
+/* Returns a pointer to the next lines in the buffer, ending with unix
+ * newlines, all found in one pass. At most count lines are taken, count is
+ * set to the number taken, and ends to one plus the index of the newline
+ * of each of them. Returns NULL if no complete line is left.
+ */
+char* get_next_lines(Buffer*, int*, int*);
+
+/* Returns the whole content of a buffer that is full without a single
+ * message having been consumed from it, which happens with messages too long
+ * to ever fit, and sets msg_len to its length. The message is followed by a
+ * null terminator. Returns NULL if the buffer is not in that state.
+ */
+char* take_overlong_msg(Buffer*, int*);
+
+/* Returns a pointer to the payload of the next complete frame in the
+ * buffer, and fills in frame with its header. Returns NULL if no complete
+ * frame is left, and sets the frame's len to -1 if the next one is too
+ * long to ever fit in the buffer.
+ */
+char* get_next_frame(Buffer*, Frame*);
+
+/* Writes the FRAME_HEADER bytes of header of the given frame to buf.
+ */
+void write_frame_header(char *, Frame *);
+
+/* Allocates a chunk holding the given frame, with one reference owned by
+ * the caller. When the frame's payload is NULL, the chunk only holds its
+ * header, and len bytes of payload are to be sent after it.
+ * Returns NULL on failure.
+ */
+OutChunk* new_frame(Frame*);
+
 /* Removes consumed characters from the buffer and shifts the rest
  * to make space for new characters.
  */
 void shift_buffer(Buffer *);
 
-/* Returns 1 if buffer is full, 0 otherwise.
+/* Returns 1 if buffer is full and cannot grow any more, 0 otherwise.
  */
 int is_buffer_full(Buffer *);
 
+/* Frees the memory held by a buffer and resets it.
+ */
+void free_buffer(Buffer *);
+
 #endif
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Synthetic job for benchmarks: prints count lines of about length bytes
+ * each, at rate lines per second (0 means as fast as possible), then exits.
+ * Every line starts with the CLOCK_MONOTONIC time it was written at, in
+ * nanoseconds, followed by its sequence number, so that a client on the
+ * same host can measure how long the line took to reach it.
+ *
+ * Usage: emit [rate] [length] [count]
+ */
+
+#define DEFAULT_RATE 100
+#define DEFAULT_LENGTH 64
+#define DEFAULT_COUNT 1000
+#define MAX_LENGTH 4096
+
+long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    long rate = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_RATE;
+    int length = argc > 2 ? strtol(argv[2], NULL, 10) : DEFAULT_LENGTH;
+    long count = argc > 3 ? strtol(argv[3], NULL, 10) : DEFAULT_COUNT;
+    if (rate < 0 || length < 0 || length > MAX_LENGTH || count < 0) {
+        fprintf(stderr, "Usage: %s [rate] [length] [count]\n", argv[0]);
+        return 1;
+    }
+
+    // One write per line, like an interactive job
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    char padding[MAX_LENGTH + 1];
+    memset(padding, 'x', length);
+    padding[length] = '\0';
+
+    long long start = now_ns();
+    for (long i = 0; i < count; i++) {
+        if (rate > 0) {
+            long long due = start + i * 1000000000LL / rate;
+            long long wait = due - now_ns();
+            if (wait > 0) {
+                struct timespec delay = {wait / 1000000000LL, 
+                                         wait % 1000000000LL};
+                nanosleep(&delay, NULL);
+            }
+        }
+
+        // Pad the line so the whole of it is about length bytes
+        char header[64];
+        int header_len = snprintf(header, sizeof(header), "%lld %ld ", 
+                                  now_ns(), i);
+        int pad = length > header_len ? length - header_len : 0;
+        printf("%s%.*s\n", header, pad, padding);
+    }
+
+    return 0;
+}
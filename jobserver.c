@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,12 +10,25 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
 
 #include "socket.h"
 #include "jobprotocol.h"
+#include "stats.h"
+#include "log.h"
+#include "shard.h"
+#include "uring.h"
 
-#define QUEUE_LENGTH 5
-#define MAX_CLIENTS 20
+#define QUEUE_LENGTH 128
+#define MAX_EVENTS 64
+
+// Most lines of job output announced at once
+#define LINE_BATCH 256
 
 #ifndef JOBS_DIR
     #define JOBS_DIR "jobs/"
@@ -23,11 +37,102 @@
 // Global list of jobs
 JobList job_list;
 
+// Most jobs that may run at once, changed at runtime with maxjobs
+int max_jobs = MAX_JOBS;
+
+// Run requests waiting for a free job slot
+RunQueue run_queue;
+
+// Flow policy of new jobs, set with -f
+FlowPolicy default_flow = FLOW_BLOCK;
+
+// Number of jobs whose pipes are not being read, see throttle_job()
+int paused_jobs;
+
+// Number of jobs whose stdout waits for raw watchers, see splice_job_output()
+int raw_waiting_jobs;
+
 // Flag to keep track of SIGINT received
 int sigint_received;
 
-// Number of clients currently connected
-int client_count;
+// Connected clients, indexed by socket fd
+ClientTable clients;
+
+// Most clients that may be connected at once, changed at runtime with
+// maxclients
+int max_clients = MAX_CLIENTS;
+
+// Bytes that may be queued for a client before it is disconnected as too
+// slow, set with -w
+int client_high_water = CLIENT_HIGH_WATER;
+
+// epoll instance that every listened-on fd is registered with
+int epoll_fd;
+
+// Event source for the listening socket
+EventSource listen_source = {EV_LISTEN, NULL};
+
+// Event source for the signalfd that reports SIGCHLD and SIGUSR1
+EventSource signal_source = {EV_SIGNAL, NULL};
+
+// Clients waiting to be closed once the current batch of events is handled
+Client *closing_clients;
+
+// Directory that job output is journaled to, set with -j, NULL if it is not
+char *journal_dir;
+
+// Journals of running jobs, and of finished ones until they are reaped
+JournalList journals;
+
+// Whether the log is written without blocking, and waits for writability
+int log_nonblocking;
+int log_waiting;
+
+// Event source for the log, while records wait for it to become writable
+EventSource log_source = {EV_LOG, NULL};
+
+// Number of shards the server is split into, set with -s, and the one this
+// process runs
+int shard_count = 1;
+int this_shard;
+
+// Links to the other shards, indexed by shard, NULL for this one and for
+// shards that are gone
+Client *shard_links[MAX_SHARDS];
+
+// Number of links still open, which do not count as clients
+int open_links;
+
+// Which shard runs every job, NULL unless the server is sharded
+ShardDirectory *directory;
+
+// Jobs of other shards watched by clients of this one
+RemoteJobList remote_jobs;
+
+// Commands forwarded to other shards, waiting for their answers
+RelayTable relays;
+
+// io_uring that accepts connections and sends queued output to clients,
+// when the server runs with -u and the kernel supports it
+Uring ring;
+int use_uring = USE_URING;
+
+// Event source for the io_uring, which is readable once requests complete
+EventSource uring_source = {EV_URING, NULL};
+
+// Listening socket the io_uring accepts connections on
+int accept_fd = -1;
+
+// Clients whose output was queued during the loop turn, written at its
+// end, see take_due_clients(). Doubly linked, so that a client leaves it
+// in constant time when it is closed or its output goes out early
+Client *sending_clients;
+
+// Milliseconds until the earliest deadline of a corked client, -1 if none
+int flush_timeout = -1;
+
+// Number of io_uring sends submitted but not completed
+int sends_in_flight;
 
 /* SIGINT handler:
  * We are just raising the sigint_received flag here. Our program will
@@ -40,395 +145,2538 @@ void sigint_handler(int code) {
     sigint_received = 1;
 }
 
-// SIGCHLD (child stopped or terminated) handler: mark jobs as dead
-void sigchld_handler(int code) {
-    int stat;
-    int pid = wait(&stat);
 
-    mark_job_dead(&job_list, pid, stat);
+int announce_buf_to_client(Client *client, char *buf, int buflen);
+int announce_str_to_client(Client *client, char* str);
+int announce_fstr_to_client(Client *client, const char *format, ...);
+long long replay_scrollback(Client *client, JobNode *job, long long line);
+int send_journal(Client *client, Journal *journal, off_t offset);
+int send_frame_to_client(Client *client, int type, unsigned int id, 
+                         const char *payload, int len);
+int process_client_frames(Client *client, JobList *job_list);
+void resume_job(JobNode *job);
+int open_raw_pipe(Client *client);
+int flush_raw_pipe(Client *client);
+void flush_client(Client *client);
+void submit_send_now(Client *client);
+void unschedule_send(Client *client);
+int raw_watchers_pending(JobNode *job);
+int remote_shard(Client *client, int pid, DirectoryEntry *entry);
+void forward_command(Client *client, int shard, char *msg, int msg_len);
+void watch_remote_job(Client *client, int pid, int shard, char *pattern, 
+                      int regex);
+void filter_watcher(Client *client, WatcherList *watchers, int pid, 
+                    char *pattern, int regex);
+Journal *open_remote_journal(Client *client, int pid, Journal *journal);
+void prune_remote_jobs(void);
+void lose_shard(Client *link);
+int process_shard_frames(Client *link, JobList *job_list);
+
+/*
+ *  Event loop
+ */
+
+/* Registers fd with the event loop for readability. Events on fd will be
+ * reported with the given source. Returns 0 on success, -1 on error.
+ */
+int watch_fd(int fd, EventSource *source) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = source;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/* Stops reporting events for fd. This must happen before fd is closed, as a
+ * copy of it inherited by a job would otherwise keep it registered.
+ */
+void unwatch_fd(int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Writes out the records logged while handling the last batch of events.
+ * Records a non-blocking log did not take are written once it becomes
+ * writable again, rather than blocking the loop.
+ */
+void flush_server_log(void) {
+    int waiting = flush_log() > 0 && log_nonblocking;
+    if (waiting == log_waiting) {
+        return;
+    }
+    if (waiting) {
+        struct epoll_event event;
+        event.events = EPOLLOUT;
+        event.data.ptr = &log_source;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDOUT_FILENO, &event) < 0) {
+            perror("epoll_ctl");
+            return;
+        }
+    } else {
+        unwatch_fd(STDOUT_FILENO);
+    }
+    log_waiting = waiting;
+}
+
+/* Changes the events reported for a client's socket. Clients with queued
+ * output also wait for writability.
+ */
+void set_client_events(Client *client, int events) {
+    if (client->events == events) {
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = &(client->source);
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->socket_fd, &event);
+    client->events = events;
+}
+
+/* Registers both output pipes of a job with the event loop.
+ * Returns 0 on success, -1 on error.
+ */
+int watch_job(JobNode *job) {
+    if (watch_fd(job->stdout_fd, &(job->stdout_source)) < 0) {
+        return -1;
+    }
+    if (watch_fd(job->stderr_fd, &(job->stderr_source)) < 0) {
+        unwatch_fd(job->stdout_fd);
+        return -1;
+    }
+    return 0;
 }
 
-int announce_buf_to_client(int client_fd, char *buf, int buflen);
-int announce_str_to_client(int client_fd, char* str);
-int announce_fstr_to_client(int client_fd, const char *format, ...);
-int get_highest_fd(int listen_fd, Client *clients, JobList *job_list);
+/* Stops or resumes readability events for the output pipes of a job, as
+ * its flags say: a paused job is not read from at all, and the stdout of a
+ * job waiting for its raw watchers is left alone. Pipes that reached end of
+ * file are not registered anymore, and are left alone.
+ */
+void update_job_reading(JobNode *job) {
+    struct epoll_event event;
+    event.events = job->paused || job->raw_waiting ? 0 : EPOLLIN;
+    event.data.ptr = &(job->stdout_source);
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, job->stdout_fd, &event);
+    event.events = job->paused ? 0 : EPOLLIN;
+    event.data.ptr = &(job->stderr_source);
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, job->stderr_fd, &event);
+    errno = 0;
+}
 
 /*
  *  Client management
  */
 
-/* Accept a connection and adds them to list of clients.
- * Return the new client's file descriptor or -1 on error.
+/* Adds a client connected on fd to a free slot in the table of clients,
+ * and to the event loop. Returns the client, or NULL on error, in which
+ * case fd is closed.
+ */
+Client *register_client(int fd) {
+    Client *client = new_client(&clients, fd);
+    if (client == NULL) {
+        close(fd);
+        return NULL;
+    }
+    client->source.kind = EV_CLIENT;
+    client->source.owner = client;
+    client->events = EPOLLIN;
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 || 
+            watch_fd(fd, &(client->source)) < 0) {
+        close(fd);
+        free_client(&clients, client);
+        return NULL;
+    }
+    return client;
+}
+
+/* Adds a freshly accepted connection to a free slot in the table of
+ * clients. Connections past max_clients are told so and closed right away,
+ * rather than left to pile up in the listen backlog.
+ * Return the new client's file descriptor, 0 if it was refused, or -1 on
+ * error.
+ */
+int admit_client(int new_fd) {
+    if (clients.count - open_links >= max_clients) {
+        char msg[] = "[SERVER] Too many clients\r\n";
+        send(new_fd, msg, sizeof(msg) - 1, MSG_DONTWAIT);
+        close(new_fd);
+        stats.clients_refused++;
+        log_fstr(LOG_INFO, "[CLIENT %d] Refused, %d clients connected", 
+                 new_fd, clients.count - open_links);
+        return 0;
+    }
+
+    if (register_client(new_fd) == NULL) {
+        return -1;
+    }
+    stats.clients_accepted++;
+
+    return new_fd;
+}
+
+/* Accept a connection and adds them to a free slot in the table of
+ * clients, see admit_client().
+ * Return the new client's file descriptor, 0 if it was refused, or -1 on
+ * error.
  */
-int setup_new_client(int listen_fd, Client *clients) {
+int setup_new_client(int listen_fd) {
     int new_fd = accept_connection(listen_fd);
     if (new_fd < 0) {
         return -1;
     }
+    return admit_client(new_fd);
+}
 
-    Client new_client = {new_fd};
-    clients[client_count] = new_client;
-    client_count++;
-
-    return new_fd;
+/* Adds the link to another shard to the table of clients, as a client in
+ * binary mode. Returns 0 on success, -1 otherwise.
+ */
+int setup_shard_link(int fd, int shard) {
+    Client *link = register_client(fd);
+    if (link == NULL) {
+        return -1;
+    }
+    link->binary = 1;
+    link->peer_shard = shard;
+    shard_links[shard] = link;
+    open_links++;
+    return 0;
 }
 
-/* Closes a client and removes it from the list of clients.
- * Return the highest fd between all clients.
+/* Closes a client and frees up its slot in the table of clients.
+ * Client slots never move, so event sources pointing at other clients
+ * remain valid.
  */
-int remove_client(int listen_fd, int client_index, Client *clients, JobList *job_list) {
-    int client_fd = clients[client_index].socket_fd;
+void remove_client(Client *client, JobList *job_list) {
+    int client_fd = client->socket_fd;
 
+    unwatch_fd(client_fd);
     close(client_fd);
+    if (client->raw_pipe[0] >= 0) {
+        close(client->raw_pipe[0]);
+        close(client->raw_pipe[1]);
+    }
+    empty_queue(&(client->out_queue));
+    free_buffer(&(client->buffer));
+    unschedule_send(client);
+
+    // Remove client from jobs, and drop the runs it is still waiting for
+    remove_client_from_all_watchers(client);
+    remove_client_runs(&run_queue, client);
+
+    // Answers from other shards to its commands are dropped, and nobody
+    // watches the jobs of a shard that is gone
+    if (relays.busy > 0) {
+        drop_client_relays(&relays, client);
+    }
+    if (client->peer_shard >= 0) {
+        lose_shard(client);
+    }
+    free_client(&clients, client);
 
-    client_count--;
-    for (int i = client_index; i < client_count; i++) {
-        clients[i] = clients[i + 1];
+    if (remote_jobs.count > 0) {
+        prune_remote_jobs();
     }
+}
 
-    // Remove client from jobs
-    remove_client_from_all_watchers(job_list, client_fd);
-    
-    return get_highest_fd(listen_fd, clients, job_list);
+/* Marks a client to be closed once the current batch of events has been
+ * handled. Nothing more is read from or written to it in the meantime.
+ * Closing it right away could free a watcher that is being iterated over.
+ */
+void close_client_later(Client *client) {
+    if (client->closing) {
+        return;
+    }
+    client->closing = 1;
+    client->next_closing = closing_clients;
+    closing_clients = client;
 }
 
-/* Read message from client and act accordingly.
- * Return their fd if it has been closed or 0 otherwise.
+/* Closes every client marked by close_client_later(). Clients with a send
+ * in flight wait for it to complete, so the kernel is done with their
+ * queue, and stop getting events from the event loop in the meantime.
+ * Their socket is shut down, so a send stuck on a client that does not
+ * read fails instead of waiting forever.
  */
-int process_client_request(Client *client, JobList *job_list, fd_set *all_fds) {
-    Buffer *client_buf = &(client->buffer);
-    int client_fd = client->socket_fd;
+void close_pending_clients(JobList *job_list) {
+    Client *still_sending = NULL;
+    while (closing_clients != NULL) {
+        Client *client = closing_clients;
+        closing_clients = client->next_closing;
+        if (client->sending) {
+            unwatch_fd(client->socket_fd);
+            shutdown(client->socket_fd, SHUT_RDWR);
+            client->next_closing = still_sending;
+            still_sending = client;
+            continue;
+        }
 
-    int read_res = read_to_buf(client_fd, client_buf);
-    if (read_res == 0) {
-        return client_fd;
-    } else if (read_res == -1) {
-        return 0;
+        int client_fd = client->socket_fd;
+        record_sample(&stats.client_bytes_sent, client->bytes_sent);
+        remove_client(client, job_list);
+
+        log_fstr(LOG_INFO, "[CLIENT %d] Connection closed", client_fd);
     }
+    closing_clients = still_sending;
+}
 
-    int msg_len;
-    char *msg;
-    while ((msg = get_next_msg(client_buf, &msg_len, NEWLINE_CRLF)) != NULL) {
-        msg[msg_len - 2] = '\0';
+/* Adds a job started at the given time on behalf of a client, who starts
+ * out watching it, to the job list and the event loop.
+ * Returns 0 on success, or -1 if the job had to be dropped.
+ */
+int add_job_for_client(Client *client, JobList *job_list, JobNode *job, 
+                       long long started) {
+    if (add_watcher(&(job->watcher_list), client) < 0 || 
+            add_job(job_list, job) < 0) {
+        kill_job_node(job);
+        delete_job_node(job);
+        stats.jobs_failed++;
+        return -1;
+    }
+    if (watch_job(job) < 0) {
+        kill_job_node(job);
+    }
+    if (directory != NULL && publish_job(directory, this_shard, job->pid) < 0) {
+        log_fstr(LOG_ERROR, "[SERVER] Job %d is not visible to other shards", 
+                 job->pid);
+    }
+    if (journal_dir != NULL && 
+            (job->journal = open_journal(&journals, journal_dir, job->pid)) == NULL) {
+        log_fstr(LOG_ERROR, "[SERVER] Could not journal the output of job %d", 
+                 job->pid);
+    }
+    if (directory != NULL && job->journal != NULL) {
+        publish_journal_len(directory, this_shard, job->pid, 0);
+    }
+    job->started_us = started;
+    job->flow = default_flow;
+    stats.jobs_started++;
+    return 0;
+}
 
-        int log_len;
-        char cmd_log[BUFSIZE];
-        snprintf(cmd_log, BUFSIZE, "[CLIENT %d] %s", client_fd, msg);
-        log_len = strlen(cmd_log);
-        cmd_log[log_len] = '\n';
-        write(STDOUT_FILENO, cmd_log, log_len + 1);
-
-        char cpy[msg_len - 1];
-        strncpy(cpy, msg, msg_len - 1);
-        JobCommand command = get_job_command(cpy);
-
-        switch (command) {
-            case CMD_LISTJOBS:
-            {
-                char jobs[BUFSIZE + 1] = "";
-                for (JobNode *job = job_list->first; job != NULL; 
-                        job = job->next) {
-                    if (!(job->dead)) {
-                        snprintf(jobs, BUFSIZE + 1, "%s %d", 
-                                jobs, job->pid);
-                    }
+/* Launches a job on behalf of a client, who starts out watching it, and
+ * tells the client how it went. Returns the job, or NULL if it could not
+ * be started.
+ */
+JobNode *run_job_for_client(Client *client, JobList *job_list, char *path, 
+                            char *const args[]) {
+    long long start = monotonic_us();
+    JobNode *job = start_job(path, args);
+    long long started = monotonic_us();
+    record_sample(&stats.spawn_latency, started - start);
+    if (job == NULL) {
+        stats.jobs_failed++;
+    }
+    if (job == NULL || add_job_for_client(client, job_list, job, started) < 0) {
+        announce_fstr_to_client(client, 
+                                "[SERVER] Could not start job %s", args[0]);
+        return NULL;
+    }
+    announce_fstr_to_client(client, "[SERVER] Job %d created", job->pid);
+    return job;
+}
+
+/* Runs path once for every list of arguments in argvs on behalf of a client,
+ * as far as max_jobs allows, and queues the rest. The jobs that can run
+ * right away are started in a single batch. The client gets a single line
+ * listing the pid of every job started, and how many were queued or could
+ * not be started.
+ */
+void run_jobs_for_client(Client *client, JobList *job_list, char *path, 
+                         char **argvs[], int count, int priority) {
+    int now = 0;
+    if (run_queue.first == NULL && job_list->count < max_jobs) {
+        now = max_jobs - job_list->count;
+        now = now < count ? now : count;
+    }
+
+    JobNode **jobs = malloc((now + 1) * sizeof(JobNode *));
+    char *pids = malloc(now * 12 + 1);
+    if (jobs == NULL || pids == NULL) {
+        perror("malloc");
+        free(jobs);
+        free(pids);
+        announce_fstr_to_client(client, 
+                                "[SERVER] Could not start jobs %s", argvs[0][0]);
+        return;
+    }
+
+    long long start = monotonic_us();
+    start_jobs(path, argvs, now, jobs);
+    long long started = monotonic_us();
+
+    int pids_len = 0;
+    int failed = 0;
+    pids[0] = '\0';
+    for (int i = 0; i < now; i++) {
+        record_sample(&stats.spawn_latency, (started - start) / now);
+        if (jobs[i] == NULL) {
+            stats.jobs_failed++;
+        }
+        if (jobs[i] == NULL || 
+                add_job_for_client(client, job_list, jobs[i], started) < 0) {
+            failed++;
+        } else {
+            pids_len += sprintf(pids + pids_len, " %d", jobs[i]->pid);
+        }
+    }
+
+    int queued = 0;
+    int position = 0;
+    for (int i = now; i < count; i++) {
+        int queued_at = -1;
+        if (run_queue.count < MAX_PENDING_RUNS) {
+            queued_at = enqueue_run(&run_queue, path, argvs[i], priority, 
+                                    client);
+        }
+        if (queued_at < 0) {
+            failed++;
+        } else if (queued++ == 0) {
+            position = queued_at;
+        }
+    }
+
+    char rest[BUFSIZE] = "";
+    if (queued > 0) {
+        snprintf(rest, BUFSIZE, ", %d queued from position %d", queued, 
+                 position);
+    }
+    if (failed > 0) {
+        int len = strlen(rest);
+        snprintf(rest + len, BUFSIZE - len, ", %d not started", failed);
+    }
+    announce_fstr_to_client(client, "[SERVER] Jobs %s created:%s%s", 
+                            argvs[0][0], pids_len > 0 ? pids : " none", rest);
+    free(jobs);
+    free(pids);
+}
+
+/* Starts queued runs, highest priority first, until the queue is empty or
+ * max_jobs jobs are running.
+ */
+void dispatch_pending_runs(JobList *job_list) {
+    while (job_list->count < max_jobs && run_queue.first != NULL) {
+        PendingRun *run = dequeue_run(&run_queue);
+        if (!run->client->closing) {
+            run_job_for_client(run->client, job_list, run->path, run->args);
+        }
+        delete_pending_run(run);
+    }
+}
+
+/* Emits a line with the current number of clients, jobs and queued runs,
+ * followed by every line of report_stats().
+ */
+void report_server_stats(JobList *job_list, void (*emit)(void *, char *), 
+                         void *arg) {
+    char line[BUFSIZE];
+    snprintf(line, BUFSIZE, 
+             "now: clients %d max clients %d jobs %d max jobs %d "
+             "queued runs %d", clients.count - open_links, max_clients, 
+             job_list->count, max_jobs, run_queue.count);
+    emit(arg, line);
+    if (directory != NULL) {
+        snprintf(line, BUFSIZE, 
+                 "shards: shard %d of %d links %d remote jobs %d "
+                 "forwarded commands waiting %d", this_shard, shard_count, 
+                 open_links, remote_jobs.count, relays.busy);
+        emit(arg, line);
+    }
+    snprintf(line, BUFSIZE, 
+             "pools: jobs %d/%d clients %d/%d watchers %d/%d buffers %d/%d", 
+             job_pool.used, job_pool.slots, client_pool.used, 
+             client_pool.slots, watcher_pool.used, watcher_pool.slots, 
+             buffer_pool.used, buffer_pool.slots);
+    emit(arg, line);
+    snprintf(line, BUFSIZE,
+             "log: records %lld bytes %lld dropped %lld (%lld bytes) "
+             "flushes %lld", log_stats.records, log_stats.bytes,
+             log_stats.dropped, log_stats.dropped_bytes, log_stats.flushes);
+    emit(arg, line);
+    report_stats(emit, arg);
+}
+
+/* Sends a line of stats to the client given as arg.
+ */
+void announce_stats_line(void *client, char *line) {
+    announce_fstr_to_client(client, "[SERVER] %s", line);
+}
+
+/* Logs a line of stats.
+ */
+void log_stats_line(void *arg, char *line) {
+    log_fstr(LOG_ERROR, "[SERVER] %s", line);
+}
+
+/* Splits the rest of a runmany command, which strtok() is still going
+ * through, into lists of arguments separated by ";", and runs name once
+ * for each of them, see run_jobs_for_client().
+ */
+void run_many(Client *client, JobList *job_list, char *path, char *name, 
+              int priority, int msg_len) {
+    // Every run takes its arguments, the name and a NULL, and there are at
+    // most msg_len / 2 + 1 arguments and separators
+    int max_tokens = msg_len / 2 + 2;
+    char **tokens = malloc(3 * max_tokens * sizeof(char *));
+    char ***argvs = malloc(max_tokens * sizeof(char **));
+    if (tokens == NULL || argvs == NULL) {
+        perror("malloc");
+        free(tokens);
+        free(argvs);
+        announce_fstr_to_client(client, "[SERVER] Could not start jobs %s", 
+                                name);
+        return;
+    }
+
+    int count = 1;
+    int used = 0;
+    argvs[0] = tokens;
+    tokens[used++] = name;
+    char *arg;
+    while ((arg = strtok(NULL, " ")) != NULL) {
+        if (strcmp(arg, ";") == 0) {
+            tokens[used++] = NULL;
+            argvs[count++] = tokens + used;
+            tokens[used++] = name;
+        } else {
+            tokens[used++] = arg;
+        }
+    }
+    tokens[used] = NULL;
+
+    run_jobs_for_client(client, job_list, path, argvs, count, priority);
+    free(tokens);
+    free(argvs);
+}
+
+/* Carries out a single command from a client, given as a string of
+ * msg_len characters followed by a null byte.
+ */
+void process_command(Client *client, JobList *job_list, char *msg, int msg_len) {
+    stats.commands++;
+
+    log_fstr(LOG_INFO, "[CLIENT %d] %s", client->socket_fd, msg);
+
+    char cpy[msg_len + 1];
+    strncpy(cpy, msg, msg_len + 1);
+    JobCommand command = get_job_command(cpy);
+
+    // Where a job of another shard runs, see remote_shard()
+    DirectoryEntry entry;
+    int shard;
+
+    switch (command) {
+        case CMD_LISTJOBS:
+        {
+            char jobs[BUFSIZE + 1] = "";
+            int jobs_len = 0;
+            for (JobNode *job = job_list->first; 
+                    job != NULL && jobs_len < BUFSIZE; job = job->next) {
+                if (!(job->dead)) {
+                    jobs_len += snprintf(jobs + jobs_len, 
+                            BUFSIZE + 1 - jobs_len, " %d", job->pid);
                 }
-                if (jobs[0] == '\0') {
-                    announce_str_to_client(client_fd, "[SERVER] No currently running jobs");
-                } else {
-                    announce_fstr_to_client(client_fd, "[SERVER]%s", jobs);
+            }
+            if (directory != NULL) {
+                // Followed by those of the other shards
+                int pids[BUFSIZE / 2];
+                int count = list_other_jobs(directory, this_shard, pids, 
+                                            BUFSIZE / 2);
+                for (int i = 0; i < count && jobs_len < BUFSIZE; i++) {
+                    jobs_len += snprintf(jobs + jobs_len, 
+                            BUFSIZE + 1 - jobs_len, " %d", pids[i]);
                 }
-                        
-                break;
             }
-            case CMD_RUNJOB:
-                if (job_list->count >= MAX_JOBS) {
-                    announce_str_to_client(client_fd, "[SERVER] MAXJOBS exceeded");
-                } else {
-                    char *name = strtok(NULL, " ");
-                    if (name == NULL) {
-                        announce_fstr_to_client(client_fd, "[SERVER] Invalid command: %s", msg);
-                    } else {
-                        char exe_file[BUFSIZE];
-                        snprintf(exe_file, BUFSIZE, "%s/%s", JOBS_DIR, name);
-                        if (strchr(msg, '/') != NULL) {
-                            announce_fstr_to_client(client_fd, "[SERVER] Invalid command: %s", msg);
-                        } else {
-                            char *args[BUFSIZE];
-                            args[0] = name;
-                            int i = 1;
-                            char *arg;
-                            while ((arg = strtok(NULL, " ")) != NULL) {
-                                args[i] = arg;
-                                i++;
-                            }
-                            args[i] = NULL;
-
-                            JobNode *job = start_job(exe_file, args);
-                            if (job == NULL) {
-                                return 0;
-                            } else {
-                                if (add_watcher(&(job->watcher_list), 
-                                                               client_fd) < 0) {
-                                    return 0;
-                                }
-                                add_job(job_list, job);
-                                FD_SET(job->stdout_fd, all_fds);
-                                FD_SET(job->stderr_fd, all_fds);
-                                announce_fstr_to_client(client_fd, 
-                                           "[SERVER] Job %d created", job->pid);
-                            }
-                        }
-                    }
+            if (jobs[0] == '\0') {
+                announce_str_to_client(client, "[SERVER] No currently running jobs");
+            } else {
+                announce_fstr_to_client(client, "[SERVER]%s", jobs);
+            }
+                    
+            break;
+        }
+        case CMD_RUNJOB:
+        case CMD_RUNMANY:
+        {
+            // run [-p <priority>] <name> [args...]
+            // runmany [-p <priority>] <name> [args...] [; args...]...
+            char *name = strtok(NULL, " ");
+            int priority = 0;
+            if (name != NULL && strcmp(name, "-p") == 0) {
+                char *priority_str = strtok(NULL, " ");
+                char *end = NULL;
+                if (priority_str != NULL) {
+                    priority = strtol(priority_str, &end, 10);
                 }
+                name = (end == NULL || *end != '\0') ? 
+                       NULL : strtok(NULL, " ");
+            }
+            if (name == NULL || strchr(msg, '/') != NULL) {
+                announce_fstr_to_client(client, "[SERVER] Invalid command: %s", msg);
+                break;
+            }
+
+            char exe_file[BUFSIZE];
+            snprintf(exe_file, BUFSIZE, "%s/%s", JOBS_DIR, name);
+            if (command == CMD_RUNMANY) {
+                run_many(client, job_list, exe_file, name, priority, msg_len);
                 break;
-            case CMD_KILLJOB:
-            {
-                char *pid_str = strtok(NULL, " ");
-                int pid;
-                if (pid_str == NULL || (pid = strtol(pid_str, NULL, 10)) <= 0) {
-                    announce_fstr_to_client(client_fd, "[SERVER] Invalid command: %s", msg);
-                } else if (kill_job(job_list, pid) == 1) {
-                    announce_fstr_to_client(client_fd, "[SERVER] Job %d not found", pid);
+            }
+            char *args[BUFSIZE];
+            args[0] = name;
+            int i = 1;
+            char *arg;
+            while (i < BUFSIZE - 1 && (arg = strtok(NULL, " ")) != NULL) {
+                args[i] = arg;
+                i++;
+            }
+            args[i] = NULL;
+
+            if (job_list->count < max_jobs && run_queue.first == NULL) {
+                run_job_for_client(client, job_list, exe_file, args);
+            } else if (run_queue.count >= MAX_PENDING_RUNS) {
+                announce_str_to_client(client, "[SERVER] MAXJOBS exceeded");
+            } else {
+                int position = enqueue_run(&run_queue, exe_file, args, 
+                                           priority, client);
+                if (position < 0) {
+                    announce_fstr_to_client(client, 
+                            "[SERVER] Could not start job %s", name);
+                } else {
+                    announce_fstr_to_client(client, 
+                            "[SERVER] Job %s queued at position %d", 
+                            name, position);
                 }
+            }
+            break;
+        }
+        case CMD_KILLJOB:
+        {
+            char *pid_str = strtok(NULL, " ");
+            int pid;
+            if (pid_str == NULL || (pid = strtol(pid_str, NULL, 10)) <= 0) {
+                announce_fstr_to_client(client, "[SERVER] Invalid command: %s", msg);
+            } else if (kill_job(job_list, pid) != 1) {
                 break;
+            } else if ((shard = remote_shard(client, pid, &entry)) >= 0) {
+                forward_command(client, shard, msg, msg_len);
+            } else {
+                announce_fstr_to_client(client, "[SERVER] Job %d not found", pid);
             }
-            case CMD_WATCHJOB:
-            {
-                char *pid_str = strtok(NULL, " ");
-                int pid;
-                if (pid_str == NULL || (pid = strtol(pid_str, NULL, 10)) <= 0) {
-                    announce_fstr_to_client(client_fd, 
-                                            "[SERVER] Invalid command: %s", 
-                                            msg);
+            break;
+        }
+        case CMD_WATCHJOB:
+        {
+            char *pid_str = strtok(NULL, " ");
+            char *option = strtok(NULL, " ");
+            int grep = option != NULL && (strcmp(option, "--grep") == 0 
+                                          || strcmp(option, "--regex") == 0);
+            // A pattern runs to the end of the line, spaces included
+            char *pattern = grep ? strtok(NULL, "") : NULL;
+            char *count_str = grep ? NULL : strtok(NULL, " ");
+            int pid;
+            long long count = 0;
+            if (pid_str == NULL || (pid = strtol(pid_str, NULL, 10)) <= 0 
+                    || (grep && pattern == NULL)
+                    || (option != NULL && !grep && (count_str == NULL 
+                        || (count = strtoll(count_str, NULL, 10)) < 0 
+                        || (strcmp(option, "-n") != 0 
+                            && strcmp(option, "-o") != 0)))) {
+                announce_fstr_to_client(client, 
+                                        "[SERVER] Invalid command: %s", 
+                                        msg);
+            } else if (grep) {
+                // Only the matching lines, without toggling the watch off
+                int regex = strcmp(option, "--regex") == 0;
+                JobNode *job = find_job(job_list, pid);
+                if (job != NULL) {
+                    filter_watcher(client, &(job->watcher_list), pid, 
+                                   pattern, regex);
+                } else if ((shard = remote_shard(client, pid, &entry)) >= 0) {
+                    watch_remote_job(client, pid, shard, pattern, regex);
                 } else {
-                    int result = remove_watcher_by_pid(job_list, pid, 
-                                                       client_fd);
-                    if (result == 0) {
-                        announce_fstr_to_client(client_fd, 
-                                     "[SERVER] No longer watching job %d", pid);
-                    } else if (result == 1) {
-                        announce_fstr_to_client(client_fd, 
-                                              "[SERVER] Job %d not found", pid);
-                    } else {
-                        if (add_watcher_by_pid(job_list, pid, client_fd) < 0) {
-                            return 0;
-                        }
-                        announce_fstr_to_client(client_fd, 
-                                               "[SERVER] Watching job %d", pid);
+                    announce_fstr_to_client(client, 
+                                          "[SERVER] Job %d not found", pid);
+                }
+            } else if (option != NULL) {
+                // Replay from a line offset, or the last count lines
+                JobNode *job = find_job(job_list, pid);
+                if (job == NULL && 
+                        (shard = remote_shard(client, pid, &entry)) >= 0) {
+                    announce_fstr_to_client(client, 
+                            "[SERVER] Job %d runs on shard %d, its output "
+                            "cannot be replayed from this one", pid, shard);
+                    break;
+                }
+                if (job == NULL) {
+                    announce_fstr_to_client(client, 
+                                          "[SERVER] Job %d not found", pid);
+                    break;
+                }
+                if (!has_watcher(&(job->watcher_list), client) 
+                        && add_watcher(&(job->watcher_list), client) < 0) {
+                    announce_fstr_to_client(client, 
+                            "[SERVER] Could not watch job %d", pid);
+                    break;
+                }
+                Scrollback *scrollback = &(job->scrollback);
+                long long line = count;
+                if (strcmp(option, "-n") == 0) {
+                    line = scrollback->first + scrollback->count - count;
+                }
+                if (line < scrollback->first) {
+                    line = scrollback->first;
+                }
+                announce_fstr_to_client(client, 
+                        "[SERVER] Watching job %d from line %lld", 
+                        pid, line);
+                replay_scrollback(client, job, line);
+            } else {
+                int result = remove_watcher_by_pid(job_list, pid, 
+                                                   client);
+                if (result == 0) {
+                    announce_fstr_to_client(client, 
+                                 "[SERVER] No longer watching job %d", pid);
+                } else if (result == 1 && 
+                        (shard = remote_shard(client, pid, &entry)) >= 0) {
+                    watch_remote_job(client, pid, shard, NULL, 0);
+                } else if (result == 1) {
+                    announce_fstr_to_client(client, 
+                                          "[SERVER] Job %d not found", pid);
+                } else {
+                    if (add_watcher_by_pid(job_list, pid, client) < 0) {
+                        return;
                     }
+                    announce_fstr_to_client(client, 
+                                           "[SERVER] Watching job %d", pid);
                 }
-                break;
             }
-            default:    
-                announce_fstr_to_client(client_fd, "[SERVER] Invalid command: %s", msg);
+            break;
+        }
+        case CMD_MAXJOBS:
+        {
+            char *limit_str = strtok(NULL, " ");
+            int limit;
+            if (limit_str == NULL) {
+                announce_fstr_to_client(client, 
+                        "[SERVER] Max jobs is %d", max_jobs);
+            } else if ((limit = strtol(limit_str, NULL, 10)) <= 0) {
+                announce_fstr_to_client(client, "[SERVER] Invalid command: %s", msg);
+            } else {
+                max_jobs = limit;
+                announce_fstr_to_client(client, 
+                        "[SERVER] Max jobs set to %d", max_jobs);
+                dispatch_pending_runs(job_list);
+            }
+            break;
+        }
+        case CMD_MAXCLIENTS:
+        {
+            char *limit_str = strtok(NULL, " ");
+            int limit;
+            if (limit_str == NULL) {
+                announce_fstr_to_client(client, 
+                        "[SERVER] Max clients is %d", max_clients);
+            } else if ((limit = strtol(limit_str, NULL, 10)) <= 0) {
+                announce_fstr_to_client(client, "[SERVER] Invalid command: %s", msg);
+            } else {
+                // Clients already connected past the new limit stay
+                max_clients = limit;
+                announce_fstr_to_client(client, 
+                        "[SERVER] Max clients set to %d", max_clients);
+            }
+            break;
+        }
+        case CMD_FLOW:
+        {
+            // flow <pid> [block|drop|kill]
+            char *pid_str = strtok(NULL, " ");
+            char *policy_str = strtok(NULL, " ");
+            int pid;
+            int policy = 0;
+            JobNode *job;
+            if (pid_str == NULL || (pid = strtol(pid_str, NULL, 10)) <= 0 || 
+                    (policy_str != NULL && 
+                     (policy = parse_flow_policy(policy_str)) < 0)) {
+                announce_fstr_to_client(client, "[SERVER] Invalid command: %s", msg);
+            } else if ((job = find_job(job_list, pid)) == NULL && 
+                    (shard = remote_shard(client, pid, &entry)) >= 0) {
+                forward_command(client, shard, msg, msg_len);
+            } else if (job == NULL) {
+                announce_fstr_to_client(client, 
+                                        "[SERVER] Job %d not found", pid);
+            } else if (policy_str == NULL) {
+                announce_fstr_to_client(client, "[SERVER] Job %d flow is %s%s",
+                                        pid, flow_policy_name(job->flow), 
+                                        job->paused ? ", paused" : "");
+            } else {
+                // A throttled job gets another chance under its new policy
+                job->flow = policy;
+                resume_job(job);
+                announce_fstr_to_client(client, 
+                                        "[SERVER] Job %d flow set to %s", 
+                                        pid, flow_policy_name(job->flow));
+            }
+            break;
+        }
+        case CMD_WATCHRAW:
+        {
+            // watch-raw <pid>, again to stop
+            char *pid_str = strtok(NULL, " ");
+            int pid;
+            JobNode *job;
+            if (pid_str == NULL || (pid = strtol(pid_str, NULL, 10)) <= 0) {
+                announce_fstr_to_client(client, "[SERVER] Invalid command: %s", msg);
+            } else if (client->binary) {
+                announce_str_to_client(client, 
+                        "[SERVER] Raw output is not sent in binary mode");
+            } else if ((job = find_job(job_list, pid)) == NULL && 
+                    (shard = remote_shard(client, pid, &entry)) >= 0) {
+                announce_fstr_to_client(client, 
+                        "[SERVER] Job %d runs on shard %d, it cannot be "
+                        "watched raw from this one", pid, shard);
+            } else if (job == NULL) {
+                announce_fstr_to_client(client, 
+                                        "[SERVER] Job %d not found", pid);
+            } else if (remove_watcher(&(job->raw_watchers), client) == 0) {
+                announce_fstr_to_client(client, 
+                        "[SERVER] No longer watching job %d raw", pid);
+            } else if (open_raw_pipe(client) < 0 || 
+                    add_watcher(&(job->raw_watchers), client) < 0) {
+                announce_fstr_to_client(client, 
+                        "[SERVER] Could not watch job %d raw", pid);
+            } else {
+                announce_fstr_to_client(client, 
+                        "[SERVER] Watching job %d raw", pid);
+            }
+            break;
+        }
+        case CMD_CORK:
+        {
+            // cork [ms]
+            char *ms_str = strtok(NULL, " ");
+            int ms;
+            if (ms_str == NULL) {
+                announce_fstr_to_client(client, "[SERVER] Cork is %d ms", 
+                                        client->cork_ms);
+            } else if ((ms = strtol(ms_str, NULL, 10)) < 0 || 
+                    ms > MAX_CORK_MS) {
+                announce_fstr_to_client(client, "[SERVER] Invalid command: %s", msg);
+            } else {
+                // Output held back already goes by the old deadline
+                client->cork_ms = ms;
+                announce_fstr_to_client(client, "[SERVER] Cork set to %d ms", 
+                                        ms);
+            }
+            break;
+        }
+        case CMD_STATS:
+            report_server_stats(job_list, announce_stats_line, client);
+            break;
+        case CMD_TAIL:
+        case CMD_CAT:
+        {
+            char *pid_str = strtok(NULL, " ");
+            char *offset_str = strtok(NULL, " ");
+            int pid;
+            long long offset = 0;
+            Journal *journal;
+            Journal remote_journal;
+            if (pid_str == NULL || (pid = strtol(pid_str, NULL, 10)) <= 0 
+                    || (command == CMD_TAIL && (offset_str == NULL 
+                        || (offset = strtoll(offset_str, NULL, 10)) < 0))) {
+                announce_fstr_to_client(client, "[SERVER] Invalid command: %s", msg);
+            } else if ((journal = find_journal(&journals, pid)) == NULL && 
+                    (journal = open_remote_journal(client, pid, 
+                                                   &remote_journal)) == NULL) {
+                announce_fstr_to_client(client, 
+                        "[SERVER] No output kept for job %d", pid);
+            } else {
+                if (offset > journal->len) {
+                    offset = journal->len;
+                }
+                announce_fstr_to_client(client, 
+                        "[SERVER] Sending %lld bytes of job %d from offset %lld", 
+                        (long long)journal->len - offset, pid, offset);
+                send_journal(client, journal, offset);
+                if (journal == &remote_journal) {
+                    close(remote_journal.fd);
+                }
+            }
+            break;
+        }
+        case CMD_REAP:
+        {
+            char *pid_str = strtok(NULL, " ");
+            int pid;
+            int result;
+            if (pid_str == NULL || (pid = strtol(pid_str, NULL, 10)) <= 0) {
+                announce_fstr_to_client(client, "[SERVER] Invalid command: %s", msg);
+            } else if ((result = reap_journal(&journals, pid)) == 0) {
+                if (directory != NULL) {
+                    withdraw_job(directory, this_shard, pid);
+                }
+                announce_fstr_to_client(client, 
+                        "[SERVER] Reaped output of job %d", pid);
+            } else if (result == 1 && 
+                    (shard = remote_shard(client, pid, &entry)) >= 0) {
+                forward_command(client, shard, msg, msg_len);
+            } else if (result == 1) {
+                announce_fstr_to_client(client, 
+                        "[SERVER] No output kept for job %d", pid);
+            } else {
+                announce_fstr_to_client(client, 
+                        "[SERVER] Job %d is still running", pid);
+            }
+            break;
+        }
+        case CMD_BINARY:
+            announce_str_to_client(client, "[SERVER] Switching to binary frames");
+            client->binary = 1;
+            break;
+        default:    
+            announce_fstr_to_client(client, "[SERVER] Invalid command: %s", msg);
+    }
+}
+
+/* Carries out a command framed by a binary client, and ends its answer
+ * with a FRAME_DONE frame, unless it was forwarded to another shard, whose
+ * answer ends it instead.
+ */
+void process_command_frame(Client *client, JobList *job_list, Frame *frame, 
+                           char *payload) {
+    client->request_id = frame->id;
+
+    // The payload is followed by the next frame, or the slack byte
+    char next = payload[frame->len];
+    payload[frame->len] = '\0';
+    process_command(client, job_list, payload, frame->len);
+    payload[frame->len] = next;
+
+    if (!client->forwarded) {
+        send_frame_to_client(client, FRAME_DONE, frame->id, NULL, 0);
+    }
+    client->forwarded = 0;
+    client->request_id = 0;
+}
+
+/* Carries out every command framed in a binary client's buffer. Each
+ * command is answered with FRAME_REPLY frames carrying its request id,
+ * followed by a FRAME_DONE frame.
+ * Return their fd if they are to be closed or 0 otherwise.
+ */
+int process_client_frames(Client *client, JobList *job_list) {
+    Buffer *client_buf = &(client->buffer);
+    if (client->peer_shard >= 0) {
+        return process_shard_frames(client, job_list);
+    }
+
+    Frame frame;
+    char *payload;
+    while ((payload = get_next_frame(client_buf, &frame)) != NULL) {
+        if (frame.type == FRAME_COMMAND) {
+            process_command_frame(client, job_list, &frame, payload);
+            continue;
+        }
+        client->request_id = frame.id;
+        announce_fstr_to_client(client, "[SERVER] Invalid frame type %d", 
+                                frame.type);
+        send_frame_to_client(client, FRAME_DONE, frame.id, NULL, 0);
+        client->request_id = 0;
+    }
+
+    if (frame.len < 0) {
+        // The framing is lost past a frame that does not fit in the buffer
+        announce_str_to_client(client, "[SERVER] Frame too long");
+        return client->socket_fd;
+    }
+
+    shift_buffer(client_buf);
+
+    errno = 0;
+    return 0;
+}
+
+/* Read message from client and act accordingly.
+ * Return their fd if it has been closed or 0 otherwise.
+ */
+int process_client_request(Client *client, JobList *job_list) {
+    Buffer *client_buf = &(client->buffer);
+    int client_fd = client->socket_fd;
+
+    int read_res = read_to_buf(client_fd, client_buf);
+    if (read_res == 0) {
+        return client_fd;
+    } else if (read_res == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            errno = 0;
+            return 0;
         }
+        // Treat a reset connection like a closed one
+        errno = 0;
+        return client_fd;
+    }
+    stats.client_bytes_read += read_res;
 
+    if (client->binary) {
+        return process_client_frames(client, job_list);
+    }
+
+    int msg_len;
+    char *msg;
+    while ((msg = get_next_msg(client_buf, &msg_len, NEWLINE_CRLF)) != NULL) {
+        msg[msg_len - 2] = '\0';
+
+        if (client->skip_msg) {
+            // This is the end of a command that was too long, drop it too
+            client->skip_msg = 0;
+            continue;
+        }
+        process_command(client, job_list, msg, msg_len - 2);
+        if (client->binary) {
+            // The rest of what the client sent is framed
+            return process_client_frames(client, job_list);
+        }
+    }
+
+    if (take_overlong_msg(client_buf, &msg_len) != NULL) {
+        client->skip_msg = 1;
+        announce_str_to_client(client, "[SERVER] Command too long");
+    }
+
+    shift_buffer(client_buf);
+
+    errno = 0;
+    return 0;
+}
+
+/*
+ *  Sending to client
+ */
+
+/* Has a client's queued output written at the end of the loop turn, unless
+ * it is on its way already: it waits for the client's socket to become
+ * writable, or an io_uring send is in flight. Output for a corked client
+ * waits until cork_ms after this call.
+ */
+void schedule_send(Client *client) {
+    if (client->sending || client->send_scheduled || 
+            (client->events & EPOLLOUT)) {
+        return;
+    }
+    client->send_scheduled = 1;
+    if (client->cork_ms > 0) {
+        client->cork_deadline = monotonic_us() + client->cork_ms * 1000LL;
+    }
+    client->prev_sending = NULL;
+    client->next_sending = sending_clients;
+    if (sending_clients != NULL) {
+        sending_clients->prev_sending = client;
+    }
+    sending_clients = client;
+}
+
+/* Takes a client off the list of clients whose output is written at the
+ * end of the loop turn.
+ */
+void unschedule_send(Client *client) {
+    if (!client->send_scheduled) {
+        return;
+    }
+    if (client->prev_sending != NULL) {
+        client->prev_sending->next_sending = client->next_sending;
+    } else {
+        sending_clients = client->next_sending;
+    }
+    if (client->next_sending != NULL) {
+        client->next_sending->prev_sending = client->prev_sending;
+    }
+    client->send_scheduled = 0;
+}
+
+/* Takes the clients whose output is due off the list of scheduled clients,
+ * and returns them linked by next_sending. Corked clients stay on it until
+ * their deadline passes or COALESCE_BYTES are queued for them, and
+ * flush_timeout is set to the milliseconds until the earliest deadline
+ * left.
+ */
+Client *take_due_clients(void) {
+    Client *due = NULL;
+    Client *corked = NULL;
+    long long now = 0;
+    flush_timeout = -1;
+    while (sending_clients != NULL) {
+        Client *client = sending_clients;
+        sending_clients = client->next_sending;
+        if (client->cork_ms > 0 && !client->closing && 
+                queue_memory(&(client->out_queue)) < COALESCE_BYTES) {
+            if (now == 0) {
+                now = monotonic_us();
+            }
+            long long wait = client->cork_deadline - now;
+            if (wait > 0) {
+                int ms = (wait + 999) / 1000;
+                if (flush_timeout < 0 || ms < flush_timeout) {
+                    flush_timeout = ms;
+                }
+                client->prev_sending = NULL;
+                client->next_sending = corked;
+                if (corked != NULL) {
+                    corked->prev_sending = client;
+                }
+                corked = client;
+                continue;
+            }
+        }
+        client->send_scheduled = 0;
+        client->next_sending = due;
+        due = client;
+    }
+    sending_clients = corked;
+    return due;
+}
+
+/* Queue a string for a client. Everything queued for it during a loop
+ * turn is written together at the end of the turn, see schedule_send(), or
+ * once COALESCE_BYTES are queued. Clients whose queue would hold more than
+ * client_high_water bytes in memory are disconnected.
+ * When the same string goes to several clients, *shared holds the chunk
+ * that all of their queues point to. It is allocated by the first client
+ * that needs it, and must be released by the caller when not NULL.
+ * Returns 0 on success, 1 if the string waits for the client's socket to
+ * become writable, or -1 if the client is being disconnected.
+ */
+int send_to_client(Client *client, char *buf, int buflen, OutChunk **shared) {
+    if (client->closing) {
+        stats.dropped_writes++;
+        return -1;
+    }
+
+    // Links to other shards are never dropped, the jobs they watch are
+    // throttled instead
+    OutQueue *queue = &(client->out_queue);
+    if (queue_memory(queue) + buflen > client_high_water && 
+            client->peer_shard < 0) {
+        log_fstr(LOG_INFO, "[SERVER] Client %d is too slow, disconnecting", 
+                 client->socket_fd);
+        stats.slow_disconnects++;
+        stats.dropped_writes++;
+        close_client_later(client);
+        return -1;
+    }
+    if (*shared == NULL && (*shared = new_chunk(buf, buflen)) == NULL) {
+        close_client_later(client);
+        return -1;
+    }
+    if (enqueue_chunk(queue, *shared, 0) < 0) {
+        close_client_later(client);
+        return -1;
+    }
+    if (client->events & EPOLLOUT) {
+        return 1;
+    }
+
+    schedule_send(client);
+    if (queue_memory(queue) >= COALESCE_BYTES) {
+        if (use_uring) {
+            submit_send_now(client);
+        } else {
+            flush_client(client);
+        }
+    }
+    return 0;
+}
+
+/* Write a string to a single client, see send_to_client().
+ * Returns 0 on success, 1 if part of the string was queued, or -1 if the
+ * client is being disconnected.
+ */
+int write_buf_to_client(Client *client, char *buf, int buflen) {
+    OutChunk *chunk = NULL;
+    int result = send_to_client(client, buf, buflen, &chunk);
+    if (chunk != NULL) {
+        release_chunk(chunk);
+    }
+    return result;
+}
+
+/* Sends as much queued output to a writable client as it takes, followed
+ * by its raw output, and stops waiting for writability once both are
+ * empty. Nothing is sent while an io_uring send is in flight, whose
+ * completion takes over.
+ */
+void flush_client(Client *client) {
+    if (client->sending) {
+        return;
+    }
+    int queued = client->out_queue.bytes;
+    long long writes = client->out_queue.writes;
+    int left = flush_queue(client->socket_fd, &(client->out_queue));
+    stats.write_calls += client->out_queue.writes - writes;
+    if (left >= 0) {
+        client->bytes_sent += queued - left;
+        stats.bytes_sent += queued - left;
+    }
+    if (left < 0) {
+        errno = 0;
+        close_client_later(client);
+    } else if (left == 0 && flush_raw_pipe(client) == 0) {
+        set_client_events(client, EPOLLIN);
+    } else {
+        if (left > 0 && !(client->events & EPOLLOUT)) {
+            stats.partial_writes++;
+            record_sample(&stats.queue_depth, left);
+        }
+        set_client_events(client, EPOLLIN | EPOLLOUT);
+    }
+}
+
+/* Writes the output queued for every client during the loop turn, with a
+ * single writev() per client, once it is due, see take_due_clients().
+ */
+void flush_scheduled_clients(void) {
+    Client *client = take_due_clients();
+    while (client != NULL) {
+        Client *next = client->next_sending;
+        if (!client->closing && client->out_queue.bytes > 0 && 
+                !(client->events & EPOLLOUT)) {
+            flush_client(client);
+        }
+        client = next;
+    }
+}
+
+/* Queues the lines a job kept in its scrollback, starting at the given line
+ * number, and starts sending them. The client's queue points to the same
+ * chunks as the scrollback, so only the lines replayed from the middle of
+ * a batch are copied. Older lines are skipped when all of them would take
+ * the queue past client_high_water.
+ * Returns the number of the first line sent, or -1 on error.
+ */
+long long replay_scrollback(Client *client, JobNode *job, long long line) {
+    Scrollback *scrollback = &(job->scrollback);
+    OutQueue *queue = &(client->out_queue);
+    if (line < scrollback->first) {
+        line = scrollback->first;
+    }
+    int index;
+    ScrollbackBatch *batch = find_scrollback_line(scrollback, line, &index);
+
+    int bytes = 0;
+    for (ScrollbackBatch *next = batch; next != NULL; next = next->next) {
+        bytes += next->chunk->len;
+    }
+    if (batch != NULL) {
+        bytes -= scrollback_line_start(batch, index);
+    }
+    while (batch != NULL && queue_memory(queue) + bytes > client_high_water) {
+        bytes -= batch->ends[index] - scrollback_line_start(batch, index);
+        line++;
+        if (++index == batch->count) {
+            batch = batch->next;
+            index = 0;
+        }
+    }
+    if (client->binary && bytes > 0 && 
+            send_frame_to_client(client, FRAME_OUTPUT, job->pid, NULL, bytes) < 0) {
+        return -1;
+    }
+
+    if (batch != NULL && index > 0) {
+        int start = scrollback_line_start(batch, index);
+        if (enqueue_buf(queue, batch->chunk->data + start, 
+                        batch->chunk->len - start) < 0) {
+            close_client_later(client);
+            return -1;
+        }
+        batch = batch->next;
+    }
+    for (; batch != NULL; batch = batch->next) {
+        if (enqueue_chunk(queue, batch->chunk, 0) < 0) {
+            close_client_later(client);
+            return -1;
+        }
+    }
+    flush_client(client);
+    return line;
+}
+
+/* Queues a journal from the given offset up to its current end, and starts
+ * sending it. The output is sent straight from the journal's file with
+ * sendfile(), it is neither read nor copied by the server.
+ * Returns 0 on success, or -1 if the client is being disconnected.
+ */
+int send_journal(Client *client, Journal *journal, off_t offset) {
+    OutQueue *queue = &(client->out_queue);
+    if (client->closing) {
+        return -1;
+    }
+    if (journal->len == offset) {
+        return 0;
+    }
+    if (journal->len - offset > INT_MAX - FRAME_HEADER - queue->bytes) {
+        announce_str_to_client(client, "[SERVER] Too much output queued");
+        return 0;
+    }
+    if (client->binary && send_frame_to_client(client, FRAME_OUTPUT, 
+                journal->pid, NULL, journal->len - offset) < 0) {
+        return -1;
+    }
+
+    OutChunk *chunk = new_file_chunk(journal->fd, offset, journal->len - offset);
+    if (chunk == NULL || enqueue_chunk(queue, chunk, 0) < 0) {
+        if (chunk != NULL) {
+            release_chunk(chunk);
+        }
+        close_client_later(client);
+        return -1;
+    }
+    release_chunk(chunk);
+    flush_client(client);
+    return 0;
+}
+
+
+/* Sends a frame to a client in binary mode, see send_to_client(). The
+ * payload may be NULL, see new_frame().
+ * Returns 0 on success, 1 if part of it was queued, or -1 if the client is
+ * being disconnected.
+ */
+int send_frame_to_client(Client *client, int type, unsigned int id, 
+                         const char *payload, int len) {
+    Frame frame = {type, id, payload, len};
+    OutChunk *chunk = new_frame(&frame);
+    if (chunk == NULL) {
+        close_client_later(client);
+        return -1;
+    }
+    int result = send_to_client(client, chunk->data, chunk->len, &chunk);
+    release_chunk(chunk);
+    return result;
+}
+
+/* Log message, and send network-newline message to a client, or a
+ * FRAME_REPLY frame holding it if the client is in binary mode.
+ * Returns 0 on success, 1 if it was partly queued, or -1 in case of error.
+ */
+int announce_buf_to_client(Client *client, char *buf, int buflen) {
+    log_buf(LOG_INFO, buf, buflen);
+    if (client->binary) {
+        return send_frame_to_client(client, FRAME_REPLY, client->request_id, 
+                                    buf, buflen);
+    }
+
+    buf[buflen] = '\r';
+    buf[buflen + 1] = '\n';
+    return write_buf_to_client(client, buf, buflen + 2);
+}
+
+
+/* Formats a message into buf, which holds BUFSIZE bytes, leaving space for
+ * a network newline after it. Messages that do not fit are formatted into a
+ * heap buffer instead, which the caller frees. Returns the message, or NULL
+ * on error, and sets len to its length.
+ */
+char *format_msg(char *buf, int *len, const char *format, va_list args) {
+    va_list retry;
+    va_copy(retry, args);
+
+    *len = vsnprintf(buf, BUFSIZE - 2, format, args);
+    if (*len < BUFSIZE - 2) {
+        va_end(retry);
+        return buf;
+    }
+
+    char *msg = malloc(*len + 3);
+    if (msg == NULL) {
+        perror("malloc");
+        va_end(retry);
+        return NULL;
+    }
+    vsnprintf(msg, *len + 1, format, retry);
+    va_end(retry);
+    return msg;
+}
+
+/* Log formatted string, and send network-newline string to a client.
+ * Returns 0 on success, 1 if it was partly queued, or -1 in case of error.
+ */
+int announce_fstr_to_client(Client *client, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+
+    char buf[BUFSIZE];
+    int len;
+    char *msg = format_msg(buf, &len, format, args);
+
+    va_end(args);
+
+    if (msg == NULL) {
+        return -1;
+    }
+    int result = announce_buf_to_client(client, msg, len);
+    if (msg != buf) {
+        free(msg);
+    }
+    return result;
+}
+
+/* Log string, and send network-newline string to a client.
+ * Returns 0 on success, 1 if it was partly queued, or -1 in case of error.
+ */
+int announce_str_to_client(Client *client, char* str) {
+    return announce_fstr_to_client(client, "%s", str);
+}
+
+
+/*
+ *  Announcing to watchers. Remember: leave the watch feature to the end.
+ */
+
+/* Sends text to the text mode clients in a list of watchers, and frames to
+ * those in binary mode, see send_to_client(). The text is copied into
+ * *text_chunk at most once. If filtered is set, watchers with a filter are
+ * sent its lines instead, as prepared by filter_lines(), if any matched.
+ * Returns 0 on success, 1 if it was partly queued for or could not be sent
+ * to some of them.
+ */
+int send_to_watchers(WatcherList *watcher_list, char *text, int text_len, 
+                     OutChunk **text_chunk, OutChunk *frames, int filtered) {
+    int error = 0;
+    for (WatcherNode *watcher = watcher_list->first; watcher != NULL; watcher = watcher->next) {
+        Client *client = watcher->client;
+        int result;
+        if (filtered && watcher->filter != NULL) {
+            OutChunk *matching = client->binary ? watcher->filter->frames 
+                                                : watcher->filter->text;
+            if (matching == NULL) {
+                continue;
+            }
+            result = send_to_client(client, matching->data, matching->len, 
+                                    &matching);
+        } else if (!client->binary) {
+            result = send_to_client(client, text, text_len, text_chunk);
+        } else {
+            result = send_to_client(client, frames->data, frames->len, &frames);
+        }
+        if (result != 0) {
+            error = 1;
+        }
+    }
+    return error;
+}
+
+/* Returns a droppable chunk holding the parts of buf, which ends[i] splits
+ * into count lines, of the lines that matched. They take len bytes.
+ * Returns NULL on failure.
+ */
+OutChunk *gather_lines(char *buf, int *ends, char *matched, int count, 
+                       int len) {
+    OutChunk *chunk = alloc_chunk(len);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    int offset = 0;
+    int begin = 0;
+    for (int i = 0; i < count; i++) {
+        if (matched[i]) {
+            memcpy(chunk->data + offset, buf + begin, ends[i] - begin);
+            offset += ends[i] - begin;
+        }
+        begin = ends[i];
+    }
+    chunk->droppable = 1;
+    return chunk;
+}
+
+/* Prepares the lines each filter of a list of watchers lets through, out
+ * of a batch of count lines of output, for send_to_watchers(). Every
+ * pattern is evaluated once per line, however many watchers share it.
+ * Line i is lens[i] bytes at starts[i], sent as the text that ends at
+ * text_ends[i] and, if frames is not NULL, the frame that ends at
+ * frame_ends[i], each starting where the previous line ends.
+ * The chunks must be released with release_filtered_lines().
+ * Returns 0 on success, or -1 if some filter's lines could not be kept.
+ */
+int filter_lines(WatcherList *watchers, int count, char **starts, int *lens, 
+                 char *text, int *text_ends, char *frames, int *frame_ends) {
+    int error = 0;
+    for (LineFilter *filter = watchers->filters; filter != NULL; 
+            filter = filter->next) {
+        char matched[count];
+        int text_len = 0;
+        int frames_len = 0;
+        int text_begin = 0;
+        int frame_begin = 0;
+        for (int i = 0; i < count; i++) {
+            matched[i] = filter_matches(filter, starts[i], lens[i]);
+            if (matched[i]) {
+                text_len += text_ends[i] - text_begin;
+                if (frames != NULL) {
+                    frames_len += frame_ends[i] - frame_begin;
+                }
+                stats.filter_hits++;
+            }
+            text_begin = text_ends[i];
+            frame_begin = frames != NULL ? frame_ends[i] : 0;
+        }
+        stats.filter_evals += count;
+        if (text_len == 0) {
+            continue;
+        }
+
+        filter->text = gather_lines(text, text_ends, matched, count, text_len);
+        if (frames != NULL) {
+            filter->frames = gather_lines(frames, frame_ends, matched, count, 
+                                          frames_len);
+        }
+        if (filter->text == NULL || (frames != NULL && filter->frames == NULL)) {
+            error = -1;
+        }
+    }
+    return error;
+}
+
+/* Releases the lines prepared by filter_lines().
+ */
+void release_filtered_lines(WatcherList *watchers) {
+    for (LineFilter *filter = watchers->filters; filter != NULL; 
+            filter = filter->next) {
+        if (filter->text != NULL) {
+            release_chunk(filter->text);
+            filter->text = NULL;
+        }
+        if (filter->frames != NULL) {
+            release_chunk(filter->frames);
+            filter->frames = NULL;
+        }
+    }
+}
+
+/* Has a client watch job pid through the given list of watchers, if it
+ * does not already, and only be sent the lines of its output that match
+ * the given pattern, a POSIX extended regex if the flag is set.
+ */
+void filter_watcher(Client *client, WatcherList *watchers, int pid, 
+                    char *pattern, int regex) {
+    int added = !has_watcher(watchers, client);
+    if (added && add_watcher(watchers, client) < 0) {
+        return;
+    }
+    if (set_watcher_filter(watchers, client, pattern, regex) < 0) {
+        if (added) {
+            remove_watcher(watchers, client);
+        }
+        announce_fstr_to_client(client, "[SERVER] Invalid pattern: %s", 
+                                pattern);
+        return;
+    }
+    announce_fstr_to_client(client, 
+                            "[SERVER] Watching job %d for lines matching %s", 
+                            pid, pattern);
+}
+
+/* Returns 1 if some client in the list of watchers is in binary mode.
+ */
+int has_binary_watcher(WatcherList *watcher_list) {
+    for (WatcherNode *watcher = watcher_list->first; watcher != NULL; watcher = watcher->next) {
+        if (watcher->client->binary) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Log message, and send network-newline message to a list of clients, or
+ * the given frame to those in binary mode.
+ * Returns 0 on success, 1 if it was partly queued for or could not be sent
+ * to some of them, or -1 in case of error.
+ */
+int announce_buf_to_watchers(WatcherList *watcher_list, char *buf, int buflen,
+                             Frame *frame) {
+    log_buf(LOG_INFO, buf, buflen);
+
+    buf[buflen] = '\r';
+    buf[buflen + 1] = '\n';
+
+    record_sample(&stats.watchers_per_line, watcher_list->count);
+
+    OutChunk *frame_chunk = NULL;
+    if (has_binary_watcher(watcher_list) && 
+            (frame_chunk = new_frame(frame)) == NULL) {
+        return -1;
+    }
+
+    // The message is copied at most once, into a chunk shared by every 
+    // watcher that could not take all of it right away
+    OutChunk *chunk = NULL;
+    int error = send_to_watchers(watcher_list, buf, buflen + 2, &chunk, 
+                                 frame_chunk, 0);
+    if (chunk != NULL) {
+        release_chunk(chunk);
+    }
+    if (frame_chunk != NULL) {
+        release_chunk(frame_chunk);
+    }
+    return error;
+}
+
+/* Log formatted string, and send network-newline string to a list of
+ * clients, or a frame of the given type and id holding it to those in binary
+ * mode. Returns 0 on success, 1 if it was partly queued for or could not
+ * be sent to some of them, or -1 in case of error.
+ */
+int announce_fstr_to_watchers(WatcherList *watcher_list, int type, 
+                              unsigned int id, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+
+    char buf[BUFSIZE];
+    int len;
+    char *msg = format_msg(buf, &len, format, args);
+
+    va_end(args);
+
+    if (msg == NULL) {
+        return -1;
+    }
+    Frame frame = {type, id, msg, len};
+    int result = announce_buf_to_watchers(watcher_list, msg, len, &frame);
+    if (msg != buf) {
+        free(msg);
+    }
+    return result;
+}
+
+/* Logs up to LINE_BATCH network-newline lines with unix newlines, as a
+ * single record.
+ */
+void log_lines(char *text, int *line_ends, int count) {
+    if (!log_enabled(LOG_OUTPUT)) {
+        return;
+    }
+    struct iovec iov[2 * LINE_BATCH];
+    int begin = 0;
+    for (int i = 0; i < count; i++) {
+        iov[2 * i].iov_base = text + begin;
+        iov[2 * i].iov_len = line_ends[i] - begin - 2;
+        iov[2 * i + 1].iov_base = "\n";
+        iov[2 * i + 1].iov_len = 1;
+        begin = line_ends[i];
+    }
+    log_iov(LOG_OUTPUT, iov, 2 * count);
+}
+
+/* Announces count lines of output of a job, as found by get_next_lines(),
+ * each after the given prefix. They are logged, kept in the job's
+ * scrollback and journal, and sent to its watchers, in frames of the given
+ * type to those in binary mode.
+ * The lines are framed in bulk, so all of them take a single log record,
+ * a single write to each watcher, and a single copy for every watcher,
+ * which the scrollback keeps a reference to.
+ * Returns 0 on success, 1 if they were partly queued for or could not be
+ * sent to some watchers, or -1 in case of error.
+ */
+int announce_job_lines(JobNode *job, const char *prefix, int frame_type, 
+                       char *lines, int *ends, int count) {
+    int prefix_len = strlen(prefix);
+    int text_len = ends[count - 1] + count * (prefix_len + 1);
+    WatcherList *watchers = &(job->watcher_list);
+
+    // Text that is kept or sent is built in the chunk watchers share
+    OutChunk *chunk = NULL;
+    char stack_text[LINE_BATCH * 16];
+    char *text = stack_text;
+    if (scrollback_bytes > 0 || watchers->first != NULL || 
+            text_len > (int) sizeof(stack_text)) {
+        if ((chunk = alloc_chunk(text_len)) == NULL) {
+            return -1;
+        }
+        text = chunk->data;
+    }
+
+    // Each line, without its newline, after the prefix and before a network
+    // newline, ends where the next line starts
+    int line_ends[count];
+    char *starts[count];
+    int lens[count];
+    int offset = 0;
+    int begin = 0;
+    for (int i = 0; i < count; i++) {
+        int len = ends[i] - begin - 1;
+        starts[i] = lines + begin;
+        lens[i] = len;
+        memcpy(text + offset, prefix, prefix_len);
+        memcpy(text + offset + prefix_len, lines + begin, len);
+        offset += prefix_len + len;
+        text[offset++] = '\r';
+        text[offset++] = '\n';
+        line_ends[i] = offset;
+        begin = ends[i];
+    }
+    log_lines(text, line_ends, count);
+
+    int error = 0;
+    if (scrollback_bytes > 0 && 
+            add_to_scrollback(&(job->scrollback), chunk, line_ends, count) < 0) {
+        error = -1;
+    }
+    if (job->journal != NULL && !job->journal->full) {
+        if (append_journal(job->journal, text, text_len) == 0) {
+            stats.journal_bytes += text_len;
+            if (directory != NULL) {
+                publish_journal_len(directory, this_shard, job->pid, 
+                                    job->journal->len);
+            }
+        } else {
+            log_fstr(LOG_ERROR, "[SERVER] Journal of job %d is full", job->pid);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        record_sample(&stats.watchers_per_line, watchers->count);
+    }
+
+    // Binary watchers get a frame for every line, all in one chunk
+    OutChunk *frames = NULL;
+    int frame_ends[count];
+    if (has_binary_watcher(watchers)) {
+        frames = alloc_chunk(ends[count - 1] + count * (FRAME_HEADER - 1));
+        if (frames == NULL) {
+            if (chunk != NULL) {
+                release_chunk(chunk);
+            }
+            return -1;
+        }
+        offset = 0;
+        begin = 0;
+        for (int i = 0; i < count; i++) {
+            Frame frame = {frame_type, job->pid, NULL, ends[i] - begin - 1};
+            write_frame_header(frames->data + offset, &frame);
+            memcpy(frames->data + offset + FRAME_HEADER, lines + begin, 
+                   frame.len);
+            offset += FRAME_HEADER + frame.len;
+            frame_ends[i] = offset;
+            begin = ends[i];
+        }
+    }
+
+    if (watchers->filters != NULL && 
+            filter_lines(watchers, count, starts, lens, text, line_ends, 
+                         frames != NULL ? frames->data : NULL, 
+                         frame_ends) < 0) {
+        error = -1;
+    }
+    if (send_to_watchers(watchers, text, text_len, &chunk, frames, 1) != 0 && 
+            error == 0) {
+        error = 1;
+    }
+    release_filtered_lines(watchers);
+
+    // Whatever was queued is job output, which FLOW_DROP may drop
+    if (chunk != NULL) {
+        chunk->droppable = 1;
+        release_chunk(chunk);
+    }
+    if (frames != NULL) {
+        frames->droppable = 1;
+        release_chunk(frames);
+    }
+    return error;
+}
+
+/* Log string, and send network-newline string to a list of
+ * clients, or a frame of the given type and id holding it to those in binary
+ * mode. Returns 0 on success, 1 if it was partly queued for or could not
+ * be sent to some of them, or -1 in case of error.
+ */
+int announce_str_to_watchers(WatcherList *watcher_list, int type, 
+                             unsigned int id, char *str) {
+    return announce_fstr_to_watchers(watcher_list, type, id, "%s", str);
+}
+
+/*
+ *  Raw watchers
+ */
+
+/* Opens the pipe that holds a client's raw output until its socket takes
+ * it, unless it is open already. Returns 0 on success, -1 otherwise.
+ */
+int open_raw_pipe(Client *client) {
+    if (client->raw_pipe[0] >= 0) {
+        return 0;
+    }
+    if (pipe2(client->raw_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    // Only copied output needs the room, the default size does for splicing
+    fcntl(client->raw_pipe[1], F_SETPIPE_SZ, RAW_PIPE_SIZE);
+    errno = 0;
+    return 0;
+}
+
+/* Moves what a client's raw pipe holds to its socket with splice(), once
+ * its queued output has been sent, and waits for writability while some of
+ * it is left. Returns the number of bytes left in the pipe, or -1 if the
+ * client is being disconnected.
+ */
+int flush_raw_pipe(Client *client) {
+    while (client->raw_pending > 0 && client->out_queue.bytes == 0) {
+        int nbytes = splice(client->raw_pipe[0], NULL, client->socket_fd, 
+                            NULL, client->raw_pending, 
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        stats.write_calls++;
+        if (nbytes <= 0) {
+            if (nbytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                errno = 0;
+                close_client_later(client);
+                return -1;
+            }
+            errno = 0;
+            break;
+        }
+        client->raw_pending -= nbytes;
+        client->bytes_sent += nbytes;
+        stats.bytes_sent += nbytes;
+    }
+    if (client->raw_pending > 0) {
+        set_client_events(client, EPOLLIN | EPOLLOUT);
+    }
+    return client->raw_pending;
+}
+
+/* Returns 1 if the pipe of some raw watcher of a job still holds output,
+ * 0 otherwise.
+ */
+int raw_watchers_pending(JobNode *job) {
+    for (WatcherNode *watcher = job->raw_watchers.first; watcher != NULL; 
+            watcher = watcher->next) {
+        if (watcher->client->raw_pending > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Returns 1 if a job's stdout only goes to raw watchers, so it can be
+ * spliced to them rather than read into the server, 0 otherwise. Output of
+ * a dead job is read, to make sure all of it is forwarded.
+ */
+int raw_only(JobNode *job) {
+    return job->raw_watchers.first != NULL && 
+           job->watcher_list.first == NULL && job->journal == NULL && 
+           !job->dead;
+}
+
+/* Appends output read from a job's stdout to the pipe of each of its raw
+ * watchers, and starts sending it. Raw watchers whose pipe cannot take all
+ * of it are too slow, and are disconnected.
+ */
+void copy_to_raw_watchers(JobNode *job, const char *buf, int len) {
+    for (WatcherNode *watcher = job->raw_watchers.first; watcher != NULL; 
+            watcher = watcher->next) {
+        Client *client = watcher->client;
+        if (client->closing) {
+            continue;
+        }
+        if (write(client->raw_pipe[1], buf, len) != len) {
+            errno = 0;
+            log_fstr(LOG_INFO, "[SERVER] Client %d is too slow, disconnecting", 
+                     client->socket_fd);
+            stats.slow_disconnects++;
+            close_client_later(client);
+            continue;
+        }
+        client->raw_pending += len;
+        stats.raw_copied_bytes += len;
+        flush_raw_pipe(client);
+    }
+}
+
+/* Moves what a job wrote to its stdout to its raw watchers without copying
+ * it through the server: tee() duplicates it into the pipes of all raw
+ * watchers but the last, and splice() moves it into the last one's. This
+ * only happens once all of these pipes are empty, as each of them can then
+ * take everything the job's pipe holds. Until then, the job's stdout is not
+ * read, so the job blocks once its pipe fills up.
+ * Returns the number of bytes moved, 0 at end of file, or -1 if none were.
+ */
+int splice_job_output(JobNode *job) {
+    if (raw_watchers_pending(job)) {
+        if (!job->raw_waiting) {
+            job->raw_waiting = 1;
+            raw_waiting_jobs++;
+            update_job_reading(job);
+        }
+        return -1;
+    }
+
+    int len = INT_MAX;
+    for (WatcherNode *watcher = job->raw_watchers.first; watcher != NULL; 
+            watcher = watcher->next) {
+        Client *client = watcher->client;
+        int nbytes;
+        if (watcher->next != NULL) {
+            nbytes = tee(job->stdout_fd, client->raw_pipe[1], len, 
+                         SPLICE_F_NONBLOCK);
+        } else {
+            nbytes = splice(job->stdout_fd, NULL, client->raw_pipe[1], NULL, 
+                            len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+
+        if (watcher == job->raw_watchers.first) {
+            if (nbytes <= 0) {
+                // Nothing to move yet, or end of file
+                errno = 0;
+                return nbytes;
+            }
+            len = nbytes;
+        }
+        if (nbytes > 0) {
+            client->raw_pending += nbytes;
+        }
+        if (nbytes != len) {
+            // Pipes this one is behind of would get the rest twice
+            errno = 0;
+            close_client_later(client);
+            if (watcher->next == NULL) {
+                char discard[BUFSIZE];
+                int left = len - (nbytes > 0 ? nbytes : 0);
+                while (left > 0 && (nbytes = read(job->stdout_fd, discard, 
+                        left < BUFSIZE ? left : BUFSIZE)) > 0) {
+                    left -= nbytes;
+                }
+                errno = 0;
+            }
+        }
+    }
+
+    job->bytes_read += len;
+    stats.job_bytes_read += len;
+    stats.raw_spliced_bytes += len;
+    for (WatcherNode *watcher = job->raw_watchers.first; watcher != NULL; 
+            watcher = watcher->next) {
+        if (!watcher->client->closing) {
+            flush_raw_pipe(watcher->client);
+        }
+    }
+    return len;
+}
+
+/*
+ *  Flow control
+ */
+
+/* Returns 1 if a job has watchers and every one of them has more than mark
+ * bytes queued in memory, 0 otherwise.
+ */
+int watchers_backed_up(WatcherList *watchers, int mark) {
+    if (watchers->first == NULL) {
+        return 0;
+    }
+    for (WatcherNode *watcher = watchers->first; watcher != NULL; 
+            watcher = watcher->next) {
+        if (queue_memory(&(watcher->client->out_queue)) <= mark) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Applies a job's flow policy if all of its watchers are backed up: stops
+ * reading its pipes, drops the oldest of its output still queued for its
+ * watchers, or kills it. A paused or killed job is not read from until
+ * resume_job().
+ */
+void throttle_job(JobNode *job) {
+    WatcherList *watchers = &(job->watcher_list);
+    if (job->paused || !watchers_backed_up(watchers, WATCHER_HIGH_WATER)) {
+        return;
+    }
+
+    switch (job->flow) {
+        case FLOW_BLOCK:
+            stats.flow_pauses++;
+            break;
+        case FLOW_DROP:
+        {
+            for (WatcherNode *watcher = watchers->first; watcher != NULL; 
+                    watcher = watcher->next) {
+                // Chunks of a send in flight are the kernel's until it ends
+                int dropped = drop_oldest_chunks(
+                        &(watcher->client->out_queue), WATCHER_LOW_WATER, 
+                        watcher->client->sending);
+                stats.flow_dropped_bytes += dropped;
+            }
+            stats.flow_drops++;
+            return;
+        }
+        case FLOW_KILL:
+            log_fstr(LOG_INFO, "[SERVER] Job %d is too fast for its watchers, "
+                     "killing it", job->pid);
+            kill_job_node(job);
+            stats.flow_kills++;
+            break;
+    }
+    job->paused = 1;
+    paused_jobs++;
+    update_job_reading(job);
+}
+
+/* Starts reading a job's pipes again if it was paused.
+ */
+void resume_job(JobNode *job) {
+    if (!job->paused) {
+        return;
     }
+    job->paused = 0;
+    paused_jobs--;
+    update_job_reading(job);
+    stats.flow_resumes++;
+}
 
-    if (is_buffer_full(client_buf) && client_buf->consumed == 0) {
-        client_buf->consumed = 1;
+/* Resumes every paused job that some watcher caught up with, or that lost
+ * the watchers it was waiting for, and reads the stdout of jobs whose raw
+ * watchers sent all they had again. Killed jobs stay paused until they are
+ * reaped.
+ */
+void resume_jobs(JobList *job_list) {
+    for (JobNode *job = job_list->first; 
+            job != NULL && (paused_jobs > 0 || raw_waiting_jobs > 0); 
+            job = job->next) {
+        if (job->paused && job->flow != FLOW_KILL && 
+                !watchers_backed_up(&(job->watcher_list), WATCHER_LOW_WATER)) {
+            resume_job(job);
+        }
+        if (job->raw_waiting && !raw_watchers_pending(job)) {
+            job->raw_waiting = 0;
+            raw_waiting_jobs--;
+            update_job_reading(job);
+        }
     }
-
-    shift_buffer(client_buf);
-
-    errno = 0;
-    return 0;
 }
 
 /*
- *  Sending to client
+ *  Shards
  */
 
-/* Write a string to a client.
- * Returns 0 on success, 1 on failed/incomplete write, or -1 in case of error.
+/* Returns the shard that runs the job with the given pid, or keeps its
+ * journal, if a command of the given client about it is to go there: the
+ * server is sharded, the job is on another shard that is still linked, and
+ * the command does not come over a link itself. Fills in entry with the
+ * job's directory entry. Returns -1 otherwise.
  */
-int write_buf_to_client(int client_fd, char *buf, int buflen) {
-    int nbytes = write(client_fd, buf, buflen);
-    if (nbytes == buflen) {
-        return 0;
+int remote_shard(Client *client, int pid, DirectoryEntry *entry) {
+    if (directory == NULL || client->peer_shard >= 0) {
+        return -1;
     }
-    if (nbytes < 0) {
+    int shard = lookup_job(directory, pid, entry);
+    if (shard < 0 || shard == this_shard || shard_links[shard] == NULL || 
+            shard_links[shard]->closing) {
         return -1;
     }
-    return 1;
+    return shard;
 }
 
-
-/* Print message to stdout, and send network-newline message to a client.
- * Returns 0 on success, 1 on failed/incomplete write, or -1 in case of error.
+/* Forwards a command about a job of another shard to that shard. Its
+ * answer is relayed back to the client as it arrives, see
+ * process_shard_frames().
  */
-int announce_buf_to_client(int client_fd, char *buf, int buflen) {
-    buf[buflen] = '\n';
-    write(STDOUT_FILENO, buf, buflen + 1);
-
-    buf[buflen] = '\r';
-    buf[buflen + 1] = '\n';
-    return write_buf_to_client(client_fd, buf, buflen + 2);
+void forward_command(Client *client, int shard, char *msg, int msg_len) {
+    int id = add_relay(&relays, client, client->request_id);
+    if (id < 0) {
+        announce_fstr_to_client(client, 
+                                "[SERVER] Could not reach shard %d", shard);
+        return;
+    }
+    if (send_frame_to_client(shard_links[shard], FRAME_COMMAND, id, msg, 
+                             msg_len) < 0) {
+        free_relay(&relays, id);
+        announce_fstr_to_client(client, 
+                                "[SERVER] Could not reach shard %d", shard);
+        return;
+    }
+    client->forwarded = client->binary;
+    stats.shard_commands++;
 }
 
-
-/* Print string to stdout, and send network-newline string to a client.
- * Returns 0 on success, 1 on failed/incomplete write, 2 if the string
- * is too large, or -1 in case of error.
+/* Starts or stops the link to a remotely watched job's shard watching the
+ * job. Returns 0 on success, -1 if the shard could not be reached.
  */
-int announce_str_to_client(int client_fd, char* str) {
-    int len = strlen(str);
-    if (len > BUFSIZE - 2) {
-        return 2;
+int toggle_remote_watch(RemoteJob *remote) {
+    Client *link = shard_links[remote->shard];
+    if (link == NULL) {
+        return -1;
     }
-
-    char buf[BUFSIZE];
-    strncpy(buf, str, BUFSIZE - 2);
-    return announce_buf_to_client(client_fd, buf, len);
+    char command[BUFSIZE];
+    int len = snprintf(command, BUFSIZE, "watch %d", remote->pid);
+    if (send_frame_to_client(link, FRAME_COMMAND, 
+                             REMOTE_WATCH_ID | remote->pid, command, len) < 0) {
+        return -1;
+    }
+    return 0;
 }
 
-/* Print formatted string to stdout, and send network-newline string to a client.
- * Returns 0 on success, 1 on failed/incomplete write, 2 if the string
- * is too large, or -1 in case of error.
+/* Starts or stops watching a job of another shard on behalf of a client.
+ * The link to that shard watches the job there for as long as some client
+ * of this one does, and its output is passed on to them. Given a pattern,
+ * the client starts or keeps watching only the lines that match it, see
+ * filter_watcher().
  */
-int announce_fstr_to_client(int client_fd, const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-
-    char msg[BUFSIZE + 1]; // vsnprintf will add a NULL terminator, so we need +1 byte
-    vsnprintf(msg, BUFSIZE - 1, format, args); // need to make sure we have space for \r\n
+void watch_remote_job(Client *client, int pid, int shard, char *pattern, 
+                      int regex) {
+    RemoteJob *remote = find_remote_job(&remote_jobs, pid);
+    if (pattern == NULL && remote != NULL && 
+            remove_watcher(&(remote->watcher_list), client) == 0) {
+        announce_fstr_to_client(client, 
+                                "[SERVER] No longer watching job %d", pid);
+        prune_remote_jobs();
+        return;
+    }
 
-    va_end(args);
+    if (remote == NULL) {
+        remote = add_remote_job(&remote_jobs, pid, shard);
+        if (remote == NULL) {
+            return;
+        }
+        if (toggle_remote_watch(remote) < 0) {
+            delete_remote_job(&remote_jobs, remote);
+            announce_fstr_to_client(client, 
+                                    "[SERVER] Could not reach shard %d", shard);
+            return;
+        }
+    }
+    if (pattern != NULL) {
+        // A bad pattern may leave the job without watchers
+        filter_watcher(client, &(remote->watcher_list), pid, pattern, regex);
+        prune_remote_jobs();
+        return;
+    }
+    if (add_watcher(&(remote->watcher_list), client) < 0) {
+        prune_remote_jobs();
+        return;
+    }
+    announce_fstr_to_client(client, "[SERVER] Watching job %d", pid);
+}
 
-    return announce_str_to_client(client_fd, msg);
+/* Stops watching every remotely watched job that lost all of its
+ * watchers.
+ */
+void prune_remote_jobs(void) {
+    RemoteJob *remote = remote_jobs.first;
+    while (remote != NULL) {
+        RemoteJob *next = remote->next;
+        if (remote->watcher_list.first == NULL) {
+            toggle_remote_watch(remote);
+            delete_remote_job(&remote_jobs, remote);
+        }
+        remote = next;
+    }
 }
 
+/* Forgets a shard whose link is being closed, and tells the watchers of
+ * the jobs watched through it that they are not watched anymore.
+ */
+void lose_shard(Client *link) {
+    int shard = link->peer_shard;
+    shard_links[shard] = NULL;
+    open_links--;
+    log_fstr(LOG_INFO, "[SERVER] Lost the link to shard %d", shard);
+
+    RemoteJob *remote = remote_jobs.first;
+    while (remote != NULL) {
+        RemoteJob *next = remote->next;
+        if (remote->shard == shard) {
+            announce_fstr_to_watchers(&(remote->watcher_list), FRAME_REPLY, 0, 
+                    "[SERVER] Lost shard %d, no longer watching job %d", 
+                    shard, remote->pid);
+            delete_remote_job(&remote_jobs, remote);
+        }
+        remote = next;
+    }
+}
 
-/*
- *  Announcing to watchers. Remember: leave the watch feature to the end.
+/* Fills in journal with the journal that another shard keeps for a job,
+ * opened from its file, for a command of the given client. Only the
+ * output that shard last published is sent from it. The caller closes its
+ * fd. Returns journal, or NULL if there is none.
  */
+Journal *open_remote_journal(Client *client, int pid, Journal *journal) {
+    DirectoryEntry entry;
+    if (journal_dir == NULL || remote_shard(client, pid, &entry) < 0 || 
+            entry.journal_len < 0) {
+        return NULL;
+    }
+    memset(journal, 0, sizeof(Journal));
+    journal->pid = pid;
+    journal->len = entry.journal_len;
+    journal->fd = open_journal_file(journal_dir, pid);
+    if (journal->fd < 0) {
+        errno = 0;
+        return NULL;
+    }
+    return journal;
+}
 
-/* Print message to stdout, and send network-newline message to a list of
- * clients. Returns 0 on success, 1 on failed/incomplete write, or -1 in
- * case of error.
+/* Passes count lines of a remotely watched job on to its watchers, as
+ * they arrived from its shard in consecutive FRAME_STDOUT and FRAME_STDERR
+ * frames. Binary watchers get the frames as they are, text watchers get
+ * the lines after the usual prefixes, and each watcher gets all of them in
+ * a single write.
+ * Returns 0 on success, 1 if they were partly queued for or could not be
+ * sent to some watchers, or -1 in case of error.
  */
-int announce_buf_to_watchers(WatcherList *watcher_list, char *buf, int buflen) {
-    buf[buflen] = '\n';
-    write(STDOUT_FILENO, buf, buflen + 1);
+int forward_remote_lines(RemoteJob *remote, char *frames, int frames_len, 
+                         int count) {
+    WatcherList *watchers = &(remote->watcher_list);
+    char stdout_prefix[BUFSIZE];
+    char stderr_prefix[BUFSIZE];
+    int stdout_len = snprintf(stdout_prefix, BUFSIZE, "[JOB %d] ", remote->pid);
+    int stderr_len = snprintf(stderr_prefix, BUFSIZE, "*(JOB %d)* ", 
+                              remote->pid);
+
+    OutChunk *text = alloc_chunk(frames_len + 
+                                 count * (stderr_len + 2 - FRAME_HEADER));
+    if (text == NULL) {
+        return -1;
+    }
+    Buffer walk = {frames, frames_len, 0, frames_len};
+    Frame frame;
+    char *line;
+    char *starts[count];
+    int lens[count];
+    int text_ends[count];
+    int frame_ends[count];
+    int offset = 0;
+    for (int i = 0; i < count && 
+            (line = get_next_frame(&walk, &frame)) != NULL; i++) {
+        starts[i] = line;
+        lens[i] = frame.len;
+        frame_ends[i] = walk.consumed;
+        if (frame.type == FRAME_STDOUT) {
+            memcpy(text->data + offset, stdout_prefix, stdout_len);
+            offset += stdout_len;
+        } else {
+            memcpy(text->data + offset, stderr_prefix, stderr_len);
+            offset += stderr_len;
+        }
+        memcpy(text->data + offset, line, frame.len);
+        offset += frame.len;
+        text->data[offset++] = '\r';
+        text->data[offset++] = '\n';
+        text_ends[i] = offset;
+    }
+    text->len = offset;
 
-    buf[buflen] = '\r';
-    buf[buflen + 1] = '\n';
+    OutChunk *binary = NULL;
+    if (has_binary_watcher(watchers) && 
+            (binary = new_chunk(frames, frames_len)) == NULL) {
+        release_chunk(text);
+        return -1;
+    }
 
     int error = 0;
-    for (WatcherNode *watcher = watcher_list->first; watcher != NULL; watcher = watcher->next) {
-        int res = write_buf_to_client(watcher->client_fd, buf, buflen + 2);
-        if (res < 0) {
-            return -1;
-        }
-        error += res;
+    if (watchers->filters != NULL && 
+            filter_lines(watchers, count, starts, lens, text->data, text_ends, 
+                         binary != NULL ? frames : NULL, frame_ends) < 0) {
+        error = -1;
+    }
+    if (send_to_watchers(watchers, text->data, text->len, &text, binary, 
+                         1) != 0 && error == 0) {
+        error = 1;
     }
-    return error ? 1 : 0;
+    release_filtered_lines(watchers);
+    text->droppable = 1;
+    release_chunk(text);
+    if (binary != NULL) {
+        binary->droppable = 1;
+        release_chunk(binary);
+    }
+    stats.shard_lines += count;
+    return error;
 }
 
-/* Print string to stdout, and send network-newline string to a list of
- * clients. Returns 0 on success, 1 on failed/incomplete write, 2 if the
- * string is too large, or -1 in case of error.
+/* Handles an answer from another shard: to a command forwarded there,
+ * which is relayed to the client that sent it, or to a link starting to
+ * watch a job, which tells whether the job was still there.
  */
-int announce_str_to_watchers(WatcherList *watcher_list, char *str) {
-    int len = strlen(str);
-    if (len > BUFSIZE - 2) {
-        return 2;
+void process_shard_answer(Client *link, Frame *frame, char *payload) {
+    if (frame->id & REMOTE_WATCH_ID) {
+        int pid = frame->id & ~REMOTE_WATCH_ID;
+        RemoteJob *remote = find_remote_job(&remote_jobs, pid);
+        char not_found[BUFSIZE];
+        int len = snprintf(not_found, BUFSIZE, "[SERVER] Job %d not found", 
+                           pid);
+        if (frame->type == FRAME_REPLY && remote != NULL && 
+                remote->shard == link->peer_shard && frame->len == len && 
+                memcmp(payload, not_found, len) == 0) {
+            announce_str_to_watchers(&(remote->watcher_list), FRAME_REPLY, 0, 
+                                     not_found);
+            delete_remote_job(&remote_jobs, remote);
+        }
+        return;
     }
 
-    char buf[BUFSIZE];
-    strncpy(buf, str, BUFSIZE - 2);
-    return announce_buf_to_watchers(watcher_list, buf, len);
+    Relay *relay = find_relay(&relays, frame->id);
+    if (relay == NULL) {
+        return;
+    }
+    Client *client = relay->client;
+    if (client != NULL && !client->closing) {
+        client->request_id = relay->request_id;
+        if (frame->type == FRAME_REPLY) {
+            announce_fstr_to_client(client, "%.*s", frame->len, payload);
+        } else if (client->binary) {
+            send_frame_to_client(client, FRAME_DONE, relay->request_id, 
+                                 NULL, 0);
+        }
+        client->request_id = 0;
+    }
+    if (frame->type == FRAME_DONE) {
+        free_relay(&relays, frame->id);
+    }
 }
 
-/* Print formatted string to stdout, and send network-newline string to a list of
- * clients. Returns 0 on success, 1 on failed/incomplete write, 2 if the string
- * is too large, or -1 in case of error.
+/* Handles what another shard sends over its link: commands about the jobs
+ * of this shard, answers to the commands forwarded there, and the output
+ * and exits of the jobs watched through the link. Consecutive lines of the
+ * same job are passed on to its watchers at once. A frame too long for the
+ * link's buffer, which only a line of nearly MAX_BUFSIZE bytes makes, is
+ * skipped.
+ * Returns 0, links are only closed once the other shard is gone.
  */
-int announce_fstr_to_watchers(WatcherList *watcher_list, const char *format, ...) {
-    va_list args;
-    va_start(args, format);
+int process_shard_frames(Client *link, JobList *job_list) {
+    Buffer *link_buf = &(link->buffer);
+    if (link->skip_bytes > 0) {
+        int skipped = link_buf->inbuf - link_buf->consumed;
+        skipped = skipped < link->skip_bytes ? skipped : link->skip_bytes;
+        link_buf->consumed += skipped;
+        link->skip_bytes -= skipped;
+    }
 
-    char msg[BUFSIZE + 1]; // vsnprintf will add a NULL terminator, so we need +1 byte
-    vsnprintf(msg, BUFSIZE - 1, format, args); // need to make sure we have space for \r\n
+    // Lines gathered for a remote job, as frames
+    RemoteJob *remote = NULL;
+    char *lines = NULL;
+    int lines_len = 0;
+    int count = 0;
+
+    Frame frame;
+    char *payload;
+    while ((payload = get_next_frame(link_buf, &frame)) != NULL) {
+        int is_line = frame.type == FRAME_STDOUT || frame.type == FRAME_STDERR;
+        if (count > 0 && (!is_line || frame.id != remote->pid || 
+                          count == LINE_BATCH)) {
+            forward_remote_lines(remote, lines, lines_len, count);
+            count = 0;
+        }
 
-    va_end(args);
+        switch (frame.type) {
+            case FRAME_COMMAND:
+                process_command_frame(link, job_list, &frame, payload);
+                break;
+            case FRAME_STDOUT:
+            case FRAME_STDERR:
+                if (count == 0) {
+                    remote = find_remote_job(&remote_jobs, frame.id);
+                    if (remote == NULL || remote->shard != link->peer_shard) {
+                        break;
+                    }
+                    lines = payload - FRAME_HEADER;
+                    lines_len = 0;
+                }
+                lines_len += FRAME_HEADER + frame.len;
+                count++;
+                break;
+            case FRAME_EXIT:
+                remote = find_remote_job(&remote_jobs, frame.id);
+                if (remote != NULL && remote->shard == link->peer_shard) {
+                    announce_fstr_to_watchers(&(remote->watcher_list), 
+                            FRAME_EXIT, frame.id, "%.*s", frame.len, payload);
+                    delete_remote_job(&remote_jobs, remote);
+                }
+                break;
+            case FRAME_REPLY:
+            case FRAME_DONE:
+                process_shard_answer(link, &frame, payload);
+                break;
+        }
+    }
+    if (count > 0) {
+        forward_remote_lines(remote, lines, lines_len, count);
+    }
 
-    return announce_str_to_watchers(watcher_list, msg);
+    if (frame.len < 0) {
+        uint32_t len;
+        memcpy(&len, link_buf->buf + link_buf->consumed, sizeof(len));
+        link->skip_bytes = FRAME_HEADER + ntohl(len);
+        log_fstr(LOG_ERROR, "[SERVER] Skipped a frame of %d bytes from "
+                 "shard %d", link->skip_bytes, link->peer_shard);
+        return process_shard_frames(link, job_list);
+    }
+
+    shift_buffer(link_buf);
+
+    errno = 0;
+    return 0;
 }
 
 /*
  *  Childcare
  */
 
-void process_job_output(JobNode *job_node, int fd, Buffer *buffer, char *format);
-int process_dead_children(JobList *job_list, fd_set *all_fds);
-JobNode *process_dead_child(JobList *job_list, JobNode *dead_job, fd_set *all_fds);
+int process_dead_children(JobList *job_list);
+JobNode *process_dead_child(JobList *job_list, JobNode *dead_job);
 
-/* Process output from each child, remove them if they are dead, announce to watchers.
- * Returns 1 if at least one child exists, 0 otherwise.
+/* Several exits can be merged into one SIGCHLD, so every exited child is
+ * reaped here, from the main loop, and its job is marked as dead. Shards
+ * that die before shard 0 stops them are only logged, their links report
+ * them lost.
  */
-int process_jobs(JobList *job_list, fd_set *current_fds, fd_set *all_fds) {
-    if (job_list->first == NULL) {
-        return 0;
+void reap_children(JobList *job_list) {
+    int stat;
+    int pid;
+    while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
+        // Shard 0 is also the parent of the other shards
+        int shard = reap_shard(pid);
+        if (shard < 0) {
+            mark_job_dead(job_list, pid, stat);
+        } else if (WIFSIGNALED(stat)) {
+            log_fstr(LOG_ERROR, "[SERVER] Shard %d (pid %d) was killed by "
+                     "signal %d", shard, pid, WTERMSIG(stat));
+        } else {
+            log_fstr(LOG_ERROR, "[SERVER] Shard %d (pid %d) exited with "
+                     "status %d", shard, pid, WEXITSTATUS(stat));
+        }
     }
+    errno = 0;
+}
 
-    for (JobNode *job = job_list->first; job != NULL; job = job->next) {
-        if (FD_ISSET(job->stdout_fd, current_fds)) {
-            process_job_output(job, job->stdout_fd, &(job->stdout_buffer), "[JOB %d] %s");
-        }
-        if (FD_ISSET(job->stderr_fd, current_fds)) {
-            process_job_output(job, job->stderr_fd, &(job->stderr_buffer), "*(JOB %d)* %s");
+/* SIGCHLD and SIGUSR1 are blocked and delivered through signal_fd instead.
+ * Reaps exited children, and prints the server stats on SIGUSR1.
+ */
+void process_signals(int signal_fd, JobList *job_list) {
+    int dump_stats = 0;
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR1) {
+            dump_stats = 1;
         }
     }
 
-    process_dead_children(job_list, all_fds);
-    return 1;
+    reap_children(job_list);
+    if (dump_stats) {
+        report_server_stats(job_list, log_stats_line, NULL);
+    }
 }
 
-/* Read characters from fd and store them in buffer. Announce each message found
- * to watchers of job_node with the given format, eg. "[JOB %d] %s\n".
+/* Read characters from fd and store them in buffer, until the pipe is
+ * drained or the buffer is full, so that lines are split and announced in
+ * batches of up to LINE_BATCH. Announce each message found to watchers of
+ * job_node after the given prefix format, eg. "[JOB %d] ", or in a frame of
+ * the given type to those in binary mode.
+ * Returns the number of bytes read, or the result of the first read if it
+ * read nothing, so 0 means the job closed fd.
  */
-void process_job_output(JobNode *job_node, int fd, Buffer *buffer, char *format)
+int process_job_output(JobNode *job_node, int fd, Buffer *buffer, char *format,
+                       int frame_type)
 {
-    if (is_buffer_full(buffer) || read_to_buf(fd, buffer) < 0) {
-        return;
-    } 
+    int raw = fd == job_node->stdout_fd && job_node->raw_watchers.first != NULL;
+    if (raw && raw_only(job_node)) {
+        return splice_job_output(job_node);
+    }
 
-    WatcherList *watchers = &(job_node->watcher_list);
+    if (is_buffer_full(buffer)) {
+        return -1;
+    }
 
-    int msg_len;
-    char *msg;
-    while ((msg = get_next_msg(buffer, &msg_len, NEWLINE_LF)) != NULL) {
-        msg[msg_len - 1] = '\0';
-        
-        announce_fstr_to_watchers(watchers, format, job_node->pid, msg);
+    int nbytes = 0;
+    int result;
+    do {
+        if ((result = read_to_buf(fd, buffer)) <= 0) {
+            break;
+        }
+        nbytes += result;
+        if (raw) {
+            copy_to_raw_watchers(job_node, 
+                                 buffer->buf + buffer->inbuf - result, result);
+        }
+    } while (buffer->inbuf < buffer->size);
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // A drained pipe is not an error for the rest of the loop pass
+        errno = 0;
     }
+    if (nbytes == 0) {
+        return result;
+    }
+    job_node->bytes_read += nbytes;
+    stats.job_bytes_read += nbytes;
+
+    char prefix[BUFSIZE];
+    snprintf(prefix, BUFSIZE, format, job_node->pid);
+
+    int ends[LINE_BATCH];
+    int count = LINE_BATCH;
+    char *lines;
+    while ((lines = get_next_lines(buffer, ends, &count)) != NULL) {
+        job_node->lines_read += count;
+        stats.job_lines_read += count;
+        record_sample(&stats.lines_per_batch, count);
+        announce_job_lines(job_node, prefix, frame_type, lines, ends, count);
+        count = LINE_BATCH;
+    }
+    throttle_job(job_node);
 
-    if (is_buffer_full(buffer) && buffer->consumed == 0) {
-        announce_fstr_to_watchers(watchers, 
-                        "*(SERVER)* Buffer from job %d is full. Aborting job.", 
-                        job_node->pid);
-        kill_job_node(job_node);
+    // Split lines too long for the buffer, the rest follows as another line
+    int msg_len;
+    if ((lines = take_overlong_msg(buffer, &msg_len)) != NULL) {
+        ends[0] = msg_len + 1;
+        announce_job_lines(job_node, prefix, frame_type, lines, ends, 1);
     }
 
     shift_buffer(buffer);
+    return nbytes;
+}
+
+/* Handle a readable job pipe. A pipe that reached end of file is dropped
+ * from the event loop, as it would otherwise stay readable until the job
+ * is reaped. Returns the result of process_job_output().
+ */
+int process_job_event(EventSource *source) {
+    JobNode *job = source->owner;
+    int fd;
+    int result;
+
+    if (source->kind == EV_JOB_STDOUT) {
+        fd = job->stdout_fd;
+        result = process_job_output(job, fd, &(job->stdout_buffer), 
+                                    "[JOB %d] ", FRAME_STDOUT);
+    } else {
+        fd = job->stderr_fd;
+        result = process_job_output(job, fd, &(job->stderr_buffer), 
+                                    "*(JOB %d)* ", FRAME_STDERR);
+    }
+
+    if (result == 0) {
+        unwatch_fd(fd);
+    }
+    return result;
 }
 
 /* Remove all dead children from job list, announce to watchers.
  * Returns count of dead jobs removed.
  */
-int process_dead_children(JobList *job_list, fd_set *all_fds) {
+int process_dead_children(JobList *job_list) {
     int dead_children = 0;
-  
-    JobNode **tail = &(job_list->first);
 
-    for (JobNode *job = job_list->first; job != NULL; job = *tail) {
+    JobNode *job = job_list->first;
+    while (job != NULL) {
         if (job->dead) {
-            *tail = process_dead_child(job_list, job, all_fds);
+            job = process_dead_child(job_list, job);
             dead_children++;
         } else {
-            tail = &(job->next);
+            job = job->next;
         }
     }
 
@@ -438,179 +2686,562 @@ int process_dead_children(JobList *job_list, fd_set *all_fds) {
 /* Remove the given child from the job list, announce to watchers.
  * Returns the next node that the job pointed to.
  */
-JobNode *process_dead_child(JobList *job_list, JobNode *dead_job, fd_set *all_fds) {    
+JobNode *process_dead_child(JobList *job_list, JobNode *dead_job) {
     JobNode *next = dead_job->next;
     int pid = dead_job->pid;
     int wait_status = dead_job->wait_status;
     WatcherList *watchers = &(dead_job->watcher_list);
+
+    // Forward whatever the job wrote before it exited
+    while (process_job_event(&(dead_job->stdout_source)) > 0) {
+    }
+    while (process_job_event(&(dead_job->stderr_source)) > 0) {
+    }
+    
+    stats.jobs_exited++;
+    record_sample(&stats.job_lifetime_ms, 
+                  (monotonic_us() - dead_job->started_us) / 1000);
+    record_sample(&stats.job_bytes, dead_job->bytes_read);
+    record_sample(&stats.job_lines, dead_job->lines_read);
     
     if (WIFEXITED(wait_status)) {
-        announce_fstr_to_watchers(watchers, 
+        announce_fstr_to_watchers(watchers, FRAME_EXIT, pid, 
                 "[JOB %d] Exited with status %d", pid, 
                 WEXITSTATUS(wait_status));
     } else {
-        announce_fstr_to_watchers(watchers, 
+        announce_fstr_to_watchers(watchers, FRAME_EXIT, pid, 
                 "[Job %d] Exited due to signal", pid);
     }
 
-    FD_CLR(dead_job->stdout_fd, all_fds);
-    FD_CLR(dead_job->stderr_fd, all_fds);
+    unwatch_fd(dead_job->stdout_fd);
+    unwatch_fd(dead_job->stderr_fd);
+    if (dead_job->paused) {
+        paused_jobs--;
+    }
+    if (dead_job->raw_waiting) {
+        raw_waiting_jobs--;
+    }
+    if (dead_job->journal != NULL) {
+        finish_journal(dead_job->journal);
+    }
+    if (directory != NULL && dead_job->journal != NULL) {
+        // Other shards may still read its journal, until it is reaped
+        stop_published_job(directory, this_shard, pid);
+    } else if (directory != NULL) {
+        withdraw_job(directory, this_shard, pid);
+    }
+    unlink_job(job_list, dead_job);
     delete_job_node(dead_job);
 
-    job_list->count--;
+    // Hand the freed slot to the next queued run
+    dispatch_pending_runs(job_list);
 
     return next;
 }
 
 /*
- *  Misc
+ *  io_uring
  */
 
-/* Return the highest fd between all clients and job pipes.
+/* Has the io_uring accept every connection made to the listening socket,
+ * with a single multishot request that stays armed until it fails.
+ * Returns 0 on success, -1 if the submission queue is full.
  */
-int get_highest_fd(int listen_fd, Client *clients, JobList *job_list) {
-    int max = listen_fd;
+int arm_accept(void) {
+    struct io_uring_sqe *sqe = get_sqe(&ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = accept_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (unsigned long) &listen_source;
+    return 0;
+}
 
-    for (int i = 0; i < client_count; i++) {
-        int client_socket = clients[i].socket_fd;
-        if (client_socket > max) {
-            max = client_socket;
+/* Admits the connection a multishot accept completed with, and rearms the
+ * accept if the kernel ended it. Kernels older than 5.19 have io_uring
+ * accepts but not multishot ones, and fail them with EINVAL: the listening
+ * socket is then left to epoll.
+ */
+void accept_completed(int result, unsigned int flags) {
+    if (result == -EINVAL && !(flags & IORING_CQE_F_MORE)) {
+        log_fstr(LOG_ERROR, "[SERVER] No multishot accept, accepting with "
+                 "epoll");
+        if (watch_fd(accept_fd, &listen_source) < 0) {
+            exit(1);
         }
+        accept_fd = -1;
+        return;
+    }
+    if (!(flags & IORING_CQE_F_MORE) && arm_accept() < 0) {
+        log_fstr(LOG_ERROR, "[SERVER] Could not rearm accept");
+    }
+    if (result < 0) {
+        log_fstr(LOG_ERROR, "[SERVER] accept: %s", strerror(-result));
+        return;
     }
+    stats.uring_accepts++;
+    admit_client(result);
+}
 
-    JobNode *current = job_list->first;
-    for (int i = 0; i < job_list->count; i++) {
-        if (current->stdout_fd > max) {
-            max = current->stdout_fd;
-        }
+/* Moves a client's queue past what a send wrote, and schedules the rest
+ * of its output. A socket that would block is left to the event loop,
+ * which waits for it to become writable and flushes it from there.
+ */
+void send_completed(Client *client, int result) {
+    client->sending = 0;
+    sends_in_flight--;
+    if (client->closing) {
+        return;
+    }
+    if (result == -EAGAIN) {
+        stats.partial_writes++;
+        set_client_events(client, EPOLLIN | EPOLLOUT);
+        return;
+    }
+    if (result < 0) {
+        close_client_later(client);
+        return;
+    }
+
+    advance_queue(&(client->out_queue), result);
+    client->bytes_sent += result;
+    stats.bytes_sent += result;
+    if (client->out_queue.bytes > 0) {
+        schedule_send(client);
+    } else if (flush_raw_pipe(client) == 0) {
+        set_client_events(client, EPOLLIN);
+    }
+}
 
-        if (current->stderr_fd > max) {
-            max = current->stderr_fd;
+/* Handles every completion the io_uring holds.
+ */
+void process_completions(void) {
+    struct io_uring_cqe *cqe;
+    while ((cqe = peek_cqe(&ring)) != NULL) {
+        EventSource *source = (EventSource *)(unsigned long) cqe->user_data;
+        int result = cqe->res;
+        unsigned int flags = cqe->flags;
+        seen_cqe(&ring);
+
+        if (source->kind == EV_LISTEN) {
+            accept_completed(result, flags);
+        } else {
+            send_completed(source->owner, result);
         }
+    }
+}
 
-        current = current->next;
+/* Submits every request prepared so far to the io_uring with a single
+ * system call. The kernel reads the iovecs of sends during the call, so
+ * they may be reused once it returns.
+ */
+void submit_prepared(void) {
+    if (submit_uring(&ring, 0) < 0) {
+        log_fstr(LOG_ERROR, "[SERVER] io_uring_enter: %s", strerror(errno));
+        errno = 0;
+    }
+    stats.uring_submits++;
+}
+
+/* Prepares a writev() of a client's queued output, with iov to hold its
+ * iovecs until the request is submitted.
+ * Returns 0 on success, -1 if the submission queue is full.
+ */
+int prepare_send(Client *client, struct iovec *iov) {
+    struct io_uring_sqe *sqe = get_sqe(&ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = client->socket_fd;
+    sqe->addr = (unsigned long) iov;
+    sqe->len = queue_iov(&(client->out_queue), iov, OUT_IOV_MAX);
+    sqe->user_data = (unsigned long) &(client->source);
+    client->sending = sqe->len;
+    sends_in_flight++;
+    stats.uring_sends++;
+    return 0;
+}
+
+/* Sends a client's output through the io_uring without waiting for the end
+ * of the loop turn, once COALESCE_BYTES are queued for it, so a burst does
+ * not pile up past client_high_water before flow control can act.
+ */
+void submit_send_now(Client *client) {
+    static struct iovec iov[OUT_IOV_MAX];
+    OutQueue *queue = &(client->out_queue);
+    if (client->sending || queue->first->chunk->fd >= 0) {
+        return;
+    }
+    unschedule_send(client);
+    if (prepare_send(client, iov) < 0) {
+        schedule_send(client);
+        return;
     }
+    submit_prepared();
+    process_completions();
+}
 
-    return max;
+/* Prepares a single writev() of the queued output of every client whose
+ * output is due, see take_due_clients(), and submits them along with
+ * whatever else was prepared during the loop turn. Completions are handled
+ * right away, as most sends to sockets complete during submission, until
+ * no client has output left that could go out without waiting. A file
+ * chunk at the front of a queue goes out with sendfile() instead.
+ */
+void submit_sends(void) {
+    static struct iovec iovs[URING_ENTRIES][OUT_IOV_MAX];
+    Client *due;
+    while ((due = take_due_clients()) != NULL || ring.prepared > 0) {
+        int used = 0;
+        while (due != NULL) {
+            Client *client = due;
+            due = client->next_sending;
+            OutQueue *queue = &(client->out_queue);
+            if (client->closing || queue->bytes == 0) {
+                continue;
+            }
+            if (queue->first->chunk->fd >= 0) {
+                flush_client(client);
+                continue;
+            }
+
+            if (used == URING_ENTRIES) {
+                submit_prepared();
+                used = 0;
+            }
+            if (prepare_send(client, iovs[used]) < 0) {
+                submit_prepared();
+                used = 0;
+                if (prepare_send(client, iovs[used]) < 0) {
+                    // Sent on a later turn, once the kernel catches up
+                    for (; client != NULL; client = due) {
+                        due = client->next_sending;
+                        schedule_send(client);
+                    }
+                    return;
+                }
+            }
+            used++;
+        }
+
+        if (ring.prepared > 0) {
+            submit_prepared();
+        }
+        process_completions();
+    }
 }
 
+/*
+ *  Misc
+ */
+
 /* Frees up all memory and exits.
  */
-void clean_exit(int listen_fd, Client *clients, JobList *job_list, int exit_status) {
+void clean_exit(int listen_fd, JobList *job_list, int exit_status) {
     close(listen_fd);
 
+    // The kernel is done with a queue once its send completes
+    while (sends_in_flight > 0 && submit_uring(&ring, 1) >= 0) {
+        process_completions();
+    }
+
     char msg[] = "[SERVER] Shutting down\r\n";
-    for (int i = 0; i < client_count; i++) {
-        int socket = clients[i].socket_fd;
-        write_buf_to_client(socket, msg, sizeof(msg) - 1);
-        close(socket);
+    for (int fd = 0; fd < clients.size; fd++) {
+        Client *client = clients.by_fd[fd];
+        if (client != NULL) {
+            if (client->peer_shard >= 0) {
+                // The other shard is shutting down too
+            } else if (client->binary) {
+                send_frame_to_client(client, FRAME_REPLY, 0, msg, 
+                                     sizeof(msg) - 3);
+            } else {
+                write_buf_to_client(client, msg, sizeof(msg) - 1);
+            }
+            flush_queue(fd, &(client->out_queue));
+            empty_queue(&(client->out_queue));
+            free_buffer(&(client->buffer));
+            close(fd);
+            if (client->raw_pipe[0] >= 0) {
+                close(client->raw_pipe[0]);
+                close(client->raw_pipe[1]);
+            }
+        }
     }
-    char log[] = "[SERVER] Shutting down\n";
-    write(STDOUT_FILENO, log, sizeof(log) - 1);
+    log_fstr(LOG_INFO, "[SERVER] Shutting down");
+    drain_log();
 
     kill_all_jobs(job_list);
     empty_job_list(job_list);
+    while (remote_jobs.first != NULL) {
+        delete_remote_job(&remote_jobs, remote_jobs.first);
+    }
+    empty_relay_table(&relays);
+    empty_run_queue(&run_queue);
+    empty_journal_list(&journals);
+    empty_client_table(&clients);
+    empty_pools();
+    close(epoll_fd);
+    if (use_uring) {
+        close_uring(&ring);
+    }
+    stop_shards();
 
     exit(exit_status);
 }
 
-int main(void) {
+/* Prints the command line options and exits.
+ */
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-b scrollback_bytes] [-c max_clients] "
+            "[-f block|drop|kill] [-j journal_dir] [-l error|info|output] "
+            "[-p preallocated] [-s shards] [-u] [-w client_high_water]\n", 
+            name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
     // Reset SIGINT received flag.
     sigint_received = 0;
 
+    int opt;
+    int log_level = LOG_OUTPUT;
+    int reserve = 0;
+    int flow;
+    while ((opt = getopt(argc, argv, "b:c:f:j:l:p:s:uw:")) != -1) {
+        switch (opt) {
+            case 'b':
+                scrollback_bytes = strtol(optarg, NULL, 10);
+                if (scrollback_bytes < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                max_clients = strtol(optarg, NULL, 10);
+                if (max_clients <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'f':
+                if ((flow = parse_flow_policy(optarg)) < 0) {
+                    usage(argv[0]);
+                }
+                default_flow = flow;
+                break;
+            case 'j':
+                journal_dir = optarg;
+                break;
+            case 'l':
+                if ((log_level = parse_log_level(optarg)) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'p':
+                reserve = strtol(optarg, NULL, 10);
+                if (reserve < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 's':
+                shard_count = strtol(optarg, NULL, 10);
+                if (shard_count <= 0 || shard_count > MAX_SHARDS) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'w':
+                client_high_water = strtol(optarg, NULL, 10);
+                if (client_high_water <= 0) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    log_nonblocking = init_log(STDOUT_FILENO, log_level);
+    if (reserve_pools(reserve) < 0) {
+        perror("malloc");
+        exit(1);
+    }
+
+    // Every client takes an fd, so allow as many as the hard limit does
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && 
+            files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
     // This line causes stdout and stderr not to be buffered.
     // Don't change this! Necessary for autotesting.
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
 
-    // Set up SIGCHLD handler
-    struct sigaction sigchld_act = {{sigchld_handler}};
-    sigchld_act.sa_flags = SA_RESTART;
-    sigaction(SIGCHLD, &sigchld_act, NULL);
+    // Block SIGCHLD and SIGUSR1, they are read from a signalfd in the main
+    // loop. SIGUSR1 prints the server stats.
+    sigset_t signal_set;
+    sigemptyset(&signal_set);
+    sigaddset(&signal_set, SIGCHLD);
+    sigaddset(&signal_set, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &signal_set, NULL);
+    int signal_fd = signalfd(-1, &signal_set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("signalfd");
+        exit(1);
+    }
     
     // Set up SIGINT handler
     struct sigaction sigint_act = {{sigint_handler}};
     sigint_act.sa_flags = SA_RESTART;
     sigaction(SIGINT, &sigint_act, NULL);
 
-    // Set up server socket
+    // Writes to clients that hung up fail with EPIPE instead
+    struct sigaction sigpipe_act = {{SIG_IGN}};
+    sigaction(SIGPIPE, &sigpipe_act, NULL);
+
+    // Split the server into shards, each of which carries on from here on
+    // its own. Whatever was logged so far is written out first, so the
+    // shards do not all log it again.
+    int links[MAX_SHARDS];
+    if (shard_count > 1) {
+        directory = new_shard_directory(DIRECTORY_SIZE);
+        drain_log();
+        if (directory == NULL || 
+                (this_shard = start_shards(shard_count, links)) < 0) {
+            exit(1);
+        }
+    }
+
+    // Set up server socket, every shard listens on the same port
     struct sockaddr_in *self = init_server_addr(PORT);
-    int listen_fd = setup_server_socket(self, QUEUE_LENGTH);
+    int listen_fd = setup_server_socket(self, QUEUE_LENGTH, shard_count > 1);
     if (fcntl(listen_fd, F_SETFL, O_NONBLOCK) == -1) {
         exit(1);
     }
 
-    // Initialize client tracking structure (array list)
-    Client clients[MAX_CLIENTS] = {0};
-
     // Initialize job tracking structure (linked list)
     
-    // Set up fd set(s) that we want to pass to select()
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(listen_fd, &readfds);
+    // Set up the epoll instance, everything else is registered as it appears
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    if (watch_fd(signal_fd, &signal_source) < 0) {
+        exit(1);
+    }
+
+    // With an io_uring, connections are accepted and output is sent through
+    // it, and epoll only reports its completions. Kernels without io_uring
+    // get the plain epoll loop.
+    if (use_uring && init_uring(&ring, URING_ENTRIES) < 0) {
+        log_fstr(LOG_ERROR, "[SERVER] No io_uring (%s), using epoll", 
+                 strerror(errno));
+        errno = 0;
+        use_uring = 0;
+    }
+    if (use_uring) {
+        accept_fd = listen_fd;
+        if (arm_accept() < 0 || watch_fd(ring.fd, &uring_source) < 0) {
+            exit(1);
+        }
+        submit_prepared();
+    } else if (watch_fd(listen_fd, &listen_source) < 0) {
+        exit(1);
+    }
+    for (int shard = 0; shard < shard_count && shard_count > 1; shard++) {
+        if (shard != this_shard && setup_shard_link(links[shard], shard) < 0) {
+            clean_exit(listen_fd, &job_list, 1);
+        }
+    }
 
-    int nfds = listen_fd + 1;
-    
     while (!sigint_received) {
-	    // Use select to wait on fds, also perform any necessary checks 
-	    // for errors or received signals
+        // Wait on registered fds, also perform any necessary checks 
+        // for errors or received signals
         errno = 0;
-        fd_set retread = readfds;
-        if (select(nfds, &retread, NULL, NULL, NULL) > 0) {
-            // Accept incoming connections
-            if (client_count < MAX_CLIENTS && FD_ISSET(listen_fd, &retread)) {                  int new_fd = setup_new_client(listen_fd, clients);
-                if (new_fd < 0) {
-                    if (errno != EWOULDBLOCK && errno != EAGAIN) {
-                        clean_exit(listen_fd, clients, &job_list, 1);
+        struct epoll_event events[MAX_EVENTS];
+        int nready = epoll_wait(epoll_fd, events, MAX_EVENTS, flush_timeout);
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            clean_exit(listen_fd, &job_list, 1);
+        }
+        stats.wakeups++;
+        stats.events += nready;
+        record_sample(&stats.events_per_wakeup, nready);
+
+        for (int i = 0; i < nready; i++) {
+            EventSource *source = events[i].data.ptr;
+
+            switch (source->kind) {
+                case EV_LISTEN:
+                    // Accept incoming connections
+                    if (setup_new_client(listen_fd) < 0) {
+                        if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                            clean_exit(listen_fd, &job_list, 1);
+                        }
+                        errno = 0;
                     }
-                    errno = 0;
-                } else {
-                    FD_SET(new_fd, &readfds);
-                    if (new_fd >= nfds) {
-                        nfds = new_fd + 1;
+                    break;
+                case EV_SIGNAL:
+                    process_signals(signal_fd, &job_list);
+                    break;
+                case EV_LOG:
+                    // The log is flushed once the batch has been handled
+                    break;
+                case EV_URING:
+                    process_completions();
+                    break;
+                case EV_JOB_STDOUT:
+                case EV_JOB_STDERR:
+                    process_job_event(source);
+                    break;
+                case EV_CLIENT:
+                {
+                    // Send queued output, process the client's requests or
+                    // deal with a dead connection
+                    Client *client = source->owner;
+                    if (!client->closing && (events[i].events & EPOLLOUT)) {
+                        flush_client(client);
                     }
-                }
-            }
-            // Check our job pipes, update max_fd if we got children
-            if (process_jobs(&job_list, &retread, &readfds) > 0) {
-                nfds = get_highest_fd(listen_fd, clients, &job_list) + 1;
-            }
-
-            // Check on all the connected clients, process any requests
-	    // or deal with any dead connections etc.
-            for (int i = 0; i < client_count; i++) {
-                if (FD_ISSET(clients[i].socket_fd, &retread)) {
-                    int client_fd = process_client_request(clients + i, 
-                                                           &job_list, &readfds);
+                    if (client->closing || 
+                            !(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                        break;
+                    }
+                    int client_fd = process_client_request(client, &job_list);
                     if (errno) {
-                        clean_exit(listen_fd, clients, &job_list, 1);
+                        clean_exit(listen_fd, &job_list, 1);
                     }
                     if (client_fd > 0) {
-                        nfds = remove_client(listen_fd, i, clients, &job_list)
-                                                                            + 1;
-                        FD_CLR(client_fd, &readfds);
-           
-                        char close_log[BUFSIZE + 1];
-                        snprintf(close_log, BUFSIZE + 1, 
-                                "[CLIENT %d] Connection closed", client_fd);
-                        int len = strlen(close_log);
-                        close_log[len] = '\n';
-                        write(STDOUT_FILENO, close_log, len + 1);
-                    } else {
-                        nfds = get_highest_fd(listen_fd, clients, &job_list)
-                                                                            + 1;
+                        close_client_later(client);
                     }
+                    break;
                 }
             }
-        } else if (errno == EINTR) {
-            process_dead_children(&job_list, &readfds);
-            nfds = get_highest_fd(listen_fd, clients, &job_list) + 1;
+        }
+
+        // Jobs and clients are only freed once the whole batch has been
+        // dispatched, as later events in it may still point at them
+        process_dead_children(&job_list);
+        if (use_uring) {
+            submit_sends();
         } else {
-            clean_exit(listen_fd, clients, &job_list, 1);
+            flush_scheduled_clients();
+        }
+        close_pending_clients(&job_list);
+        if (paused_jobs > 0 || raw_waiting_jobs > 0) {
+            resume_jobs(&job_list);
         }
+        flush_server_log();
     }
 
-    clean_exit(listen_fd, clients, &job_list, 0);
+    clean_exit(listen_fd, &job_list, 0);
     return 0;
 }
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "journal.h"
+
+/* Unlinks a journal from the given list. */
+static void unlink_journal(JournalList *journals, Journal *journal) {
+    Journal **link = &(journals->first);
+    while (*link != journal) {
+        link = &((*link)->next);
+    }
+    *link = journal->next;
+    journals->count--;
+}
+
+/* Unmaps and closes a journal, and frees it. */
+static void delete_journal(Journal *journal) {
+    if (journal->map != NULL) {
+        munmap(journal->map, journal->size);
+    }
+    close(journal->fd);
+    free(journal->path);
+    free(journal);
+}
+
+/* Returns the path of the journal of the job with the given pid in the
+ * given directory, allocated with malloc(), or NULL on failure.
+ */
+static char *journal_path(const char *dir, int pid) {
+    int path_len = snprintf(NULL, 0, "%s/job-%d.out", dir, pid);
+    char *path = malloc(path_len + 1);
+    if (path == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    snprintf(path, path_len + 1, "%s/job-%d.out", dir, pid);
+    return path;
+}
+
+Journal *open_journal(JournalList *journals, const char *dir, int pid) {
+    Journal *old = find_journal(journals, pid);
+    if (old != NULL && old->finished) {
+        reap_journal(journals, pid);
+    }
+
+    Journal *journal = malloc(sizeof(Journal));
+    if (journal == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(journal, 0, sizeof(Journal));
+    journal->pid = pid;
+
+    journal->path = journal_path(dir, pid);
+    if (journal->path == NULL) {
+        free(journal);
+        return NULL;
+    }
+
+    // A file left from an earlier server goes, one still in use lives on
+    // unlinked
+    unlink(journal->path);
+    journal->fd = open(journal->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 
+                       0644);
+    if (journal->fd < 0) {
+        perror("open");
+        free(journal->path);
+        free(journal);
+        return NULL;
+    }
+    // Blocks are reserved up front: a store into a hole of the mapping
+    // that the disk has no room for would raise SIGBUS
+    journal->size = JOURNAL_SEGMENT;
+    int error = posix_fallocate(journal->fd, 0, journal->size);
+    if (error != 0) {
+        fprintf(stderr, "posix_fallocate: %s\n", strerror(error));
+        unlink(journal->path);
+        delete_journal(journal);
+        return NULL;
+    }
+    journal->map = mmap(NULL, journal->size, PROT_READ | PROT_WRITE, 
+                        MAP_SHARED, journal->fd, 0);
+    if (journal->map == MAP_FAILED) {
+        perror("mmap");
+        journal->map = NULL;
+        unlink(journal->path);
+        delete_journal(journal);
+        return NULL;
+    }
+
+    journal->next = journals->first;
+    journals->first = journal;
+    journals->count++;
+    return journal;
+}
+
+/* Doubles the size of a journal's file and mapping, up to JOURNAL_MAX,
+ * reserving the blocks of the new part of the file.
+ * Returns 0 on success, -1 otherwise.
+ */
+static int grow_journal(Journal *journal) {
+    off_t size = journal->size * 2;
+    if (size > JOURNAL_MAX) {
+        size = JOURNAL_MAX;
+    }
+    int error = posix_fallocate(journal->fd, journal->size, 
+                                size - journal->size);
+    if (error != 0) {
+        fprintf(stderr, "posix_fallocate: %s\n", strerror(error));
+        return -1;
+    }
+    char *map = mremap(journal->map, journal->size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) {
+        perror("mremap");
+        return -1;
+    }
+    journal->map = map;
+    journal->size = size;
+    return 0;
+}
+
+int append_journal(Journal *journal, const char *buf, int len) {
+    if (journal->full || journal->map == NULL) {
+        return 1;
+    }
+    while (journal->len + len > journal->size) {
+        if (journal->size == JOURNAL_MAX) {
+            journal->full = 1;
+            return 1;
+        }
+        if (grow_journal(journal) < 0) {
+            journal->full = 1;
+            return -1;
+        }
+    }
+
+    memcpy(journal->map + journal->len, buf, len);
+    journal->len += len;
+    return 0;
+}
+
+void finish_journal(Journal *journal) {
+    if (journal->map != NULL) {
+        munmap(journal->map, journal->size);
+        journal->map = NULL;
+    }
+    if (ftruncate(journal->fd, journal->len) < 0) {
+        perror("ftruncate");
+    }
+    journal->finished = 1;
+}
+
+int open_journal_file(const char *dir, int pid) {
+    char *path = journal_path(dir, pid);
+    if (path == NULL) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    return fd;
+}
+
+Journal *find_journal(JournalList *journals, int pid) {
+    for (Journal *journal = journals->first; journal != NULL; 
+            journal = journal->next) {
+        if (journal->pid == pid) {
+            return journal;
+        }
+    }
+    return NULL;
+}
+
+int reap_journal(JournalList *journals, int pid) {
+    Journal *journal = find_journal(journals, pid);
+    if (journal == NULL) {
+        return 1;
+    }
+    if (!journal->finished) {
+        return 2;
+    }
+
+    unlink(journal->path);
+    unlink_journal(journals, journal);
+    delete_journal(journal);
+    return 0;
+}
+
+void empty_journal_list(JournalList *journals) {
+    while (journals->first != NULL) {
+        Journal *journal = journals->first;
+        if (!journal->finished) {
+            finish_journal(journal);
+        }
+        unlink_journal(journals, journal);
+        delete_journal(journal);
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <sys/types.h>
+
+// Bytes preallocated for a journal, doubled whenever it fills up
+#ifndef JOURNAL_SEGMENT
+    #define JOURNAL_SEGMENT (1024 * 1024)
+#endif
+
+// Most bytes of output kept in a single journal
+#ifndef JOURNAL_MAX
+    #define JOURNAL_MAX (64 * 1024 * 1024)
+#endif
+
+/* The output of a job, appended to a preallocated file that is mapped into
+ * memory while the job runs. The output lives in the page cache rather than
+ * on the server's heap, and is read back from the file with sendfile().
+ * A journal outlives its job, until it is reaped.
+ */
+struct journal {
+	int pid;
+	int fd;
+	int finished;
+	int full;
+	char *map;
+	off_t size;
+	off_t len;
+	char *path;
+	struct journal *next;
+};
+typedef struct journal Journal;
+
+struct journal_list {
+	struct journal *first;
+	int count;
+};
+typedef struct journal_list JournalList;
+
+/* Creates a journal for the job with the given pid in the given directory,
+ * and adds it to the given list. The finished journal of an earlier job
+ * with the same pid is reaped first.
+ * Returns the journal, or NULL on failure.
+ */
+Journal *open_journal(JournalList *, const char *, int);
+
+/* Appends len bytes of buf to the journal, growing its file as needed.
+ * Returns 0 on success, 1 if the journal is full, or -1 on error.
+ */
+int append_journal(Journal *, const char *, int);
+
+/* Unmaps a journal once its job is done, and trims its file to the output
+ * it holds. The file stays open to be read.
+ */
+void finish_journal(Journal *);
+
+/* Opens the file of the journal of the job with the given pid in the given
+ * directory for reading, such as one kept by another shard, see shard.h.
+ * Only as many bytes as that shard says the journal holds are output, the
+ * rest of the file is preallocated. Returns its fd, or -1 on failure.
+ */
+int open_journal_file(const char *, int);
+
+/* Returns the journal of the job with the given pid, or NULL if there is
+ * none.
+ */
+Journal *find_journal(JournalList *, int);
+
+/* Removes the journal of the job with the given pid from the list, and
+ * deletes its file.
+ * Returns 0 on success, 1 if there is no such journal, or 2 if its job has
+ * not finished.
+ */
+int reap_journal(JournalList *, int);
+
+/* Closes every journal in the list and frees it, leaving the files on disk.
+ */
+void empty_journal_list(JournalList *);
+
+#endif
@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linefilter.h"
+
+LineFilter *get_line_filter(LineFilter **filters, const char *pattern,
+                            int regex) {
+    for (LineFilter *filter = *filters; filter != NULL;
+            filter = filter->next) {
+        if (filter->regex == regex && strcmp(filter->pattern, pattern) == 0) {
+            filter->refs++;
+            return filter;
+        }
+    }
+
+    LineFilter *filter = malloc(sizeof(LineFilter) + strlen(pattern) + 1);
+    if (filter == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(filter, 0, sizeof(LineFilter));
+    strcpy(filter->pattern, pattern);
+    filter->regex = regex;
+    if (regex && regcomp(&(filter->compiled), pattern,
+                         REG_EXTENDED | REG_NOSUB) != 0) {
+        free(filter);
+        return NULL;
+    }
+    filter->refs = 1;
+    filter->next = *filters;
+    *filters = filter;
+    return filter;
+}
+
+void put_line_filter(LineFilter **filters, LineFilter *filter) {
+    if (--filter->refs > 0) {
+        return;
+    }
+
+    LineFilter **link = filters;
+    while (*link != filter) {
+        link = &((*link)->next);
+    }
+    *link = filter->next;
+    if (filter->regex) {
+        regfree(&(filter->compiled));
+    }
+    free(filter);
+}
+
+int filter_matches(LineFilter *filter, const char *line, int len) {
+    if (!filter->regex) {
+        // glibc's memmem() skips ahead with the two-way algorithm
+        return memmem(line, len, filter->pattern,
+                      strlen(filter->pattern)) != NULL;
+    }
+
+    // REG_STARTEND bounds the match by len instead of a nul
+    regmatch_t bounds = {0, len};
+    return regexec(&(filter->compiled), line, 1, &bounds, REG_STARTEND) == 0;
+}
@@ -0,0 +1,43 @@
+#ifndef __LINE_FILTER_H__
+#define __LINE_FILTER_H__
+
+#include <regex.h>
+
+/* A pattern that watchers of a job keep only the matching lines of its
+ * output with, see watch --grep and watch --regex. A plain pattern matches
+ * the lines that contain it, a regex one is a POSIX extended regular
+ * expression. Watchers with the same pattern in a list of watchers share
+ * one filter, so it is evaluated once per line however many of them there
+ * are. While a batch of lines is sent, text and frames hold the lines
+ * that matched, as sent to text and binary mode watchers, or NULL if none
+ * did.
+ */
+struct line_filter {
+	int refs;
+	int regex;
+	regex_t compiled;
+	struct out_chunk *text;
+	struct out_chunk *frames;
+	struct line_filter *next;
+	char pattern[];
+};
+typedef struct line_filter LineFilter;
+
+/* Returns the filter in the list with the given pattern, regex if the
+ * flag is set, with a new reference to it. It is added to the list if
+ * there is none yet.
+ * Returns NULL if the pattern is not a valid regex, or on failure.
+ */
+LineFilter *get_line_filter(LineFilter **, const char *, int);
+
+/* Drops a reference to a filter of the list, and frees it once no watcher
+ * uses it.
+ */
+void put_line_filter(LineFilter **, LineFilter *);
+
+/* Returns 1 if the len bytes of line, which need not end in a nul, match
+ * the filter, 0 otherwise.
+ */
+int filter_matches(LineFilter *, const char *, int);
+
+#endif
@@ -0,0 +1,137 @@
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define HAVE_X86_SPLITTERS
+#endif
+
+#include "linesplit.h"
+
+static int always_supported(void) {
+    return 1;
+}
+
+static int split_bytes(const char *buf, int n, int *ends, int max) {
+    int count = 0;
+    for (int i = 0; i < n && count < max; i++) {
+        if (buf[i] == '\n') {
+            ends[count++] = i + 1;
+        }
+    }
+    return count;
+}
+
+static int split_memchr(const char *buf, int n, int *ends, int max) {
+    int count = 0;
+    const char *start = buf;
+    const char *newline;
+    while (count < max && 
+            (newline = memchr(start, '\n', buf + n - start)) != NULL) {
+        ends[count++] = newline - buf + 1;
+        start = newline + 1;
+    }
+    return count;
+}
+
+#ifdef HAVE_X86_SPLITTERS
+
+/* Stores the newlines flagged in mask, the comparison result for the
+ * characters from offset on. Returns the new number of newlines stored.
+ */
+static inline int store_newlines(unsigned int mask, int offset, int *ends, 
+                                 int count, int max) {
+    while (mask != 0 && count < max) {
+        ends[count++] = offset + __builtin_ctz(mask) + 1;
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+static int split_sse2(const char *buf, int n, int *ends, int max) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    int count = 0;
+    int i = 0;
+    for (; i + 16 <= n && count < max; i += 16) {
+        __m128i chars = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chars, newline));
+        count = store_newlines(mask, i, ends, count, max);
+    }
+    if (count < max && i < n) {
+        int tail = split_bytes(buf + i, n - i, ends + count, max - count);
+        for (int j = count; j < count + tail; j++) {
+            ends[j] += i;
+        }
+        count += tail;
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static int split_avx2(const char *buf, int n, int *ends, int max) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    int count = 0;
+    int i = 0;
+    for (; i + 32 <= n && count < max; i += 32) {
+        __m256i chars = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned int mask = _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(chars, newline));
+        count = store_newlines(mask, i, ends, count, max);
+    }
+    if (count < max && i < n) {
+        int tail = split_sse2(buf + i, n - i, ends + count, max - count);
+        for (int j = count; j < count + tail; j++) {
+            ends[j] += i;
+        }
+        count += tail;
+    }
+    return count;
+}
+
+static int sse2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static int avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+const LineSplitter line_splitters[] = {
+    {"bytes", split_bytes, always_supported},
+#ifdef HAVE_X86_SPLITTERS
+    {"sse2", split_sse2, sse2_supported},
+#endif
+    {"memchr", split_memchr, always_supported},
+#ifdef HAVE_X86_SPLITTERS
+    {"avx2", split_avx2, avx2_supported},
+#endif
+};
+const int n_line_splitters = sizeof(line_splitters) / sizeof(LineSplitter);
+
+// The implementation in use, picked on the first call
+static const LineSplitter *best_splitter;
+
+/* Picks the last, so fastest, implementation that this CPU supports.
+ */
+static const LineSplitter *pick_splitter(void) {
+    if (best_splitter == NULL) {
+        best_splitter = &line_splitters[0];
+        for (int i = 0; i < n_line_splitters; i++) {
+            if (line_splitters[i].supported()) {
+                best_splitter = &line_splitters[i];
+            }
+        }
+    }
+    return best_splitter;
+}
+
+int find_newlines(const char *buf, int n, int *ends, int max) {
+    return pick_splitter()->split(buf, n, ends, max);
+}
+
+const char *line_splitter_name(void) {
+    return pick_splitter()->name;
+}
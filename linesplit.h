@@ -0,0 +1,35 @@
+#ifndef __LINE_SPLIT_H__
+#define __LINE_SPLIT_H__
+
+/* Finds every unix newline (\n) in a block of text in a single pass, rather
+ * than scanning for one line at a time. Several implementations are built,
+ * and the fastest one the CPU supports is picked the first time
+ * find_newlines() is called.
+ */
+
+/* Stores one plus the index of each of the first max newlines in the first
+ * n characters of buf in ends, in order. Returns the number stored.
+ */
+typedef int (*SplitFunction)(const char *, int, int *, int);
+
+struct line_splitter {
+	const char *name;
+	SplitFunction split;
+	int (*supported)(void);
+};
+typedef struct line_splitter LineSplitter;
+
+// Every implementation, slowest first. The byte by byte scan is kept to
+// compare against, see splitbench.c.
+extern const LineSplitter line_splitters[];
+extern const int n_line_splitters;
+
+/* Same as a SplitFunction, using the best implementation for this CPU.
+ */
+int find_newlines(const char *, int, int *, int);
+
+/* Returns the name of the implementation find_newlines() uses.
+ */
+const char *line_splitter_name(void);
+
+#endif
@@ -0,0 +1,186 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "log.h"
+
+LogStats log_stats;
+
+static const char *level_names[] = {"error", "info", "output"};
+
+// The ring buffer, pending records are the used bytes from start on
+static char ring[LOG_BUFFER_SIZE];
+static int ring_start;
+static int ring_used;
+
+static int log_fd = -1;
+static LogLevel log_level = LOG_OUTPUT;
+
+// Flags of the log's file before init_log() made it non-blocking, or -1
+static int saved_flags = -1;
+
+/* Makes the log's file blocking again, for the other processes that share
+ * it once the server exits.
+ */
+static void restore_log_flags(void) {
+    if (saved_flags >= 0) {
+        fcntl(log_fd, F_SETFL, saved_flags);
+        saved_flags = -1;
+    }
+}
+
+int init_log(int fd, LogLevel level) {
+    log_fd = fd;
+    log_level = level;
+
+    // Only pipes and sockets may block for long, and are not shared with the
+    // terminal that the server was started from. When stderr goes to the
+    // same file, as with 2>&1, the flag would make its messages fail too.
+    struct stat info;
+    struct stat err_info;
+    if (fstat(fd, &info) < 0 || 
+            !(S_ISFIFO(info.st_mode) || S_ISSOCK(info.st_mode))) {
+        return 0;
+    }
+    if (fd != STDERR_FILENO && fstat(STDERR_FILENO, &err_info) == 0 && 
+            err_info.st_dev == info.st_dev && err_info.st_ino == info.st_ino) {
+        return 0;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return 0;
+    }
+    if (saved_flags < 0) {
+        atexit(restore_log_flags);
+    }
+    saved_flags = flags;
+    return 1;
+}
+
+const char *log_level_name(LogLevel level) {
+    return level_names[level];
+}
+
+int parse_log_level(const char *name) {
+    for (int i = 0; i < (int) (sizeof(level_names) / sizeof(char *)); i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int log_enabled(LogLevel level) {
+    return level <= log_level;
+}
+
+/* Copies len bytes of buf to the end of the ring, which has room for them.
+ */
+static void append_ring(const char *buf, int len) {
+    int end = (ring_start + ring_used) % LOG_BUFFER_SIZE;
+    int first = LOG_BUFFER_SIZE - end < len ? LOG_BUFFER_SIZE - end : len;
+    memcpy(ring + end, buf, first);
+    memcpy(ring, buf + first, len - first);
+    ring_used += len;
+}
+
+/* Returns 1 if a record of len bytes at the given level is to be appended,
+ * and counts it as dropped when it does not fit.
+ */
+static int admit_record(LogLevel level, int len) {
+    if (!log_enabled(level)) {
+        return 0;
+    }
+    if (len > LOG_BUFFER_SIZE - ring_used) {
+        log_stats.dropped++;
+        log_stats.dropped_bytes += len;
+        return 0;
+    }
+    log_stats.records++;
+    log_stats.bytes += len;
+    return 1;
+}
+
+void log_buf(LogLevel level, const char *buf, int len) {
+    if (admit_record(level, len + 1)) {
+        append_ring(buf, len);
+        append_ring("\n", 1);
+    }
+}
+
+void log_iov(LogLevel level, const struct iovec *iov, int iovcnt) {
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (admit_record(level, len)) {
+        for (int i = 0; i < iovcnt; i++) {
+            append_ring(iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+}
+
+void log_fstr(LogLevel level, const char *format, ...) {
+    if (!log_enabled(level)) {
+        return;
+    }
+    char buf[1024];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    if (len >= (int) sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+    if (len >= 0) {
+        log_buf(level, buf, len);
+    }
+}
+
+int flush_log(void) {
+    while (ring_used > 0) {
+        struct iovec iov[2];
+        int first = LOG_BUFFER_SIZE - ring_start;
+        iov[0].iov_base = ring + ring_start;
+        iov[0].iov_len = first < ring_used ? first : ring_used;
+        iov[1].iov_base = ring;
+        iov[1].iov_len = ring_used - iov[0].iov_len;
+
+        int nbytes = writev(log_fd, iov, iov[1].iov_len > 0 ? 2 : 1);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = 0;
+                break;
+            }
+            // Nothing more can be logged, drop what is pending
+            errno = 0;
+            log_stats.dropped_bytes += ring_used;
+            ring_used = 0;
+            return -1;
+        }
+        log_stats.flushes++;
+        ring_start = (ring_start + nbytes) % LOG_BUFFER_SIZE;
+        ring_used -= nbytes;
+    }
+    if (ring_used == 0) {
+        ring_start = 0;
+    }
+    return ring_used;
+}
+
+void drain_log(void) {
+    struct pollfd writable = {log_fd, POLLOUT, 0};
+    while (flush_log() > 0) {
+        poll(&writable, 1, -1);
+    }
+}
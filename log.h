@@ -0,0 +1,71 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <sys/uio.h>
+
+// Bytes of log records that may wait to be written out
+#ifndef LOG_BUFFER_SIZE
+    #define LOG_BUFFER_SIZE (1024 * 1024)
+#endif
+
+/* Records are only logged at the level set with init_log() or a more
+ * important one. LOG_OUTPUT is the echo of every line of job output.
+ */
+typedef enum {LOG_ERROR, LOG_INFO, LOG_OUTPUT} LogLevel;
+
+/* The server log. Records are appended to a ring buffer, and written out in
+ * batches by flush_log(), which the main loop calls once per iteration.
+ * When the log goes to a pipe or a socket it is written without blocking,
+ * and whatever does not fit is kept for the next flush. Records that do not
+ * fit in the ring buffer are dropped and counted.
+ */
+struct log_stats {
+	long long records;
+	long long bytes;
+	long long dropped;
+	long long dropped_bytes;
+	long long flushes;
+};
+typedef struct log_stats LogStats;
+
+extern LogStats log_stats;
+
+/* Sends the log to fd, for records at the given level or a more important
+ * one. A pipe or socket is made non-blocking, unless stderr is the same
+ * file, and its flags are restored when the process exits.
+ * Returns 1 if fd was made non-blocking, 0 otherwise.
+ */
+int init_log(int, LogLevel);
+
+/* Returns the name of a level, or parses one. parse_log_level() returns -1
+ * for an unknown name.
+ */
+const char *log_level_name(LogLevel);
+int parse_log_level(const char *);
+
+/* Returns 1 if records at the given level are logged, 0 otherwise.
+ */
+int log_enabled(LogLevel);
+
+/* Appends a record made of len bytes of buf, followed by a newline.
+ */
+void log_buf(LogLevel, const char *, int);
+
+/* Appends a record made of the given pieces, as is.
+ */
+void log_iov(LogLevel, const struct iovec *, int);
+
+/* Appends a formatted record, followed by a newline.
+ */
+void log_fstr(LogLevel, const char *, ...);
+
+/* Writes out as many pending records as the log takes without blocking.
+ * Returns the number of bytes still pending, or -1 on error.
+ */
+int flush_log(void);
+
+/* Writes out every pending record, blocking if needed.
+ */
+void drain_log(void);
+
+#endif
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "outqueue.h"
+
+OutChunk *alloc_chunk(int len) {
+    OutChunk *chunk = malloc(sizeof(OutChunk) + len);
+    if (chunk == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    chunk->len = len;
+    chunk->refs = 1;
+    chunk->fd = -1;
+    chunk->droppable = 0;
+    chunk->offset = 0;
+    return chunk;
+}
+
+OutChunk *new_chunk(const char *buf, int buflen) {
+    OutChunk *chunk = alloc_chunk(buflen);
+    if (chunk != NULL) {
+        memcpy(chunk->data, buf, buflen);
+    }
+    return chunk;
+}
+
+OutChunk *new_file_chunk(int fd, off_t offset, int len) {
+    OutChunk *chunk = malloc(sizeof(OutChunk));
+    if (chunk == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    chunk->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (chunk->fd < 0) {
+        perror("fcntl");
+        free(chunk);
+        return NULL;
+    }
+    chunk->len = len;
+    chunk->refs = 1;
+    chunk->droppable = 0;
+    chunk->offset = offset;
+    return chunk;
+}
+
+void release_chunk(OutChunk *chunk) {
+    chunk->refs--;
+    if (chunk->refs == 0) {
+        if (chunk->fd >= 0) {
+            close(chunk->fd);
+        }
+        free(chunk);
+    }
+}
+
+int enqueue_chunk(OutQueue *queue, OutChunk *chunk, int offset) {
+    OutEntry *entry = malloc(sizeof(OutEntry));
+    if (entry == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    entry->chunk = chunk;
+    entry->next = NULL;
+    chunk->refs++;
+
+    if (queue->last == NULL) {
+        queue->first = entry;
+        queue->sent = offset;
+    } else {
+        queue->last->next = entry;
+    }
+    queue->last = entry;
+    queue->bytes += chunk->len - offset;
+    if (chunk->fd >= 0) {
+        queue->file_bytes += chunk->len - offset;
+    }
+
+    return 0;
+}
+
+int enqueue_buf(OutQueue *queue, const char *buf, int buflen) {
+    OutChunk *chunk = new_chunk(buf, buflen);
+    if (chunk == NULL) {
+        return -1;
+    }
+    int result = enqueue_chunk(queue, chunk, 0);
+    release_chunk(chunk);
+    return result;
+}
+
+void drop_first_chunk(OutQueue *queue) {
+    OutEntry *entry = queue->first;
+    queue->first = entry->next;
+    if (queue->first == NULL) {
+        queue->last = NULL;
+    }
+    queue->bytes -= entry->chunk->len - queue->sent;
+    if (entry->chunk->fd >= 0) {
+        queue->file_bytes -= entry->chunk->len - queue->sent;
+    }
+    queue->sent = 0;
+    release_chunk(entry->chunk);
+    free(entry);
+}
+
+int drop_oldest_chunks(OutQueue *queue, int target, int keep) {
+    int dropped = 0;
+    OutEntry **link = &(queue->first);
+    OutEntry *previous = NULL;
+    while (*link != NULL && queue_memory(queue) > target) {
+        OutEntry *entry = *link;
+        OutChunk *chunk = entry->chunk;
+        if (keep-- > 0 || !chunk->droppable || chunk->fd >= 0 || 
+                (entry == queue->first && queue->sent > 0)) {
+            previous = entry;
+            link = &(entry->next);
+            continue;
+        }
+
+        *link = entry->next;
+        if (queue->last == entry) {
+            queue->last = previous;
+        }
+        queue->bytes -= chunk->len;
+        dropped += chunk->len;
+        release_chunk(chunk);
+        free(entry);
+    }
+    return dropped;
+}
+
+int queue_memory(OutQueue *queue) {
+    return queue->bytes - queue->file_bytes;
+}
+
+/* Writes the chunks at the front of the queue that are held in memory with
+ * a single writev(), or the file chunk at its front with sendfile().
+ */
+static int write_front(int fd, OutQueue *queue) {
+    OutChunk *front = queue->first->chunk;
+    if (front->fd >= 0) {
+        off_t offset = front->offset + queue->sent;
+        int nbytes = sendfile(fd, front->fd, &offset, front->len - queue->sent);
+        if (nbytes == 0) {
+            // The file is shorter than the chunk, it would never be sent
+            errno = EIO;
+            return -1;
+        }
+        return nbytes;
+    }
+
+    struct iovec iov[OUT_IOV_MAX];
+    return writev(fd, iov, queue_iov(queue, iov, OUT_IOV_MAX));
+}
+
+int queue_iov(OutQueue *queue, struct iovec *iov, int max) {
+    int iovcnt = 0;
+    int offset = queue->sent;
+    for (OutEntry *entry = queue->first; entry != NULL && 
+            entry->chunk->fd < 0 && iovcnt < max; entry = entry->next) {
+        iov[iovcnt].iov_base = entry->chunk->data + offset;
+        iov[iovcnt].iov_len = entry->chunk->len - offset;
+        iovcnt++;
+        offset = 0;
+    }
+    return iovcnt;
+}
+
+void advance_queue(OutQueue *queue, int nbytes) {
+    // Drop every chunk that went out completely
+    while (queue->first != NULL && 
+            nbytes >= queue->first->chunk->len - queue->sent) {
+        nbytes -= queue->first->chunk->len - queue->sent;
+        drop_first_chunk(queue);
+    }
+    if (queue->first != NULL && nbytes > 0) {
+        queue->sent += nbytes;
+        queue->bytes -= nbytes;
+        if (queue->first->chunk->fd >= 0) {
+            queue->file_bytes -= nbytes;
+        }
+    }
+}
+
+int flush_queue(int fd, OutQueue *queue) {
+    while (queue->first != NULL) {
+        int nbytes = write_front(fd, queue);
+        queue->writes++;
+        if (nbytes < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = 0;
+                break;
+            }
+            return -1;
+        }
+
+        // A write that stops within a chunk would not get further now
+        advance_queue(queue, nbytes);
+        if (queue->first != NULL && queue->sent > 0) {
+            break;
+        }
+    }
+
+    return queue->bytes;
+}
+
+void empty_queue(OutQueue *queue) {
+    while (queue->first != NULL) {
+        drop_first_chunk(queue);
+    }
+    queue->bytes = 0;
+    queue->file_bytes = 0;
+}
@@ -0,0 +1,111 @@
+#ifndef __OUT_QUEUE_H__
+#define __OUT_QUEUE_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Most chunks handed to a single writev() when flushing a queue
+#define OUT_IOV_MAX 64
+
+/* Bytes that could not be written to a non-blocking socket right away are
+ * kept in a queue, and sent once the socket becomes writable. The bytes
+ * themselves live in reference counted chunks, so a message fanned out to
+ * many clients is stored once no matter how many queues hold it.
+ * A chunk can also stand for len bytes of a file from offset on, which are
+ * sent with sendfile() and take no memory. Its fd is -1 otherwise.
+ * Chunks marked droppable may be dropped from a queue that backs up, see
+ * drop_oldest_chunks().
+ */
+struct out_chunk {
+	int refs;
+	int len;
+	int fd;
+	int droppable;
+	off_t offset;
+	char data[];
+};
+typedef struct out_chunk OutChunk;
+
+struct out_entry {
+	struct out_chunk *chunk;
+	struct out_entry *next;
+};
+typedef struct out_entry OutEntry;
+
+struct out_queue {
+	struct out_entry *first;
+	struct out_entry *last;
+	int sent;
+	int bytes;
+	int file_bytes;
+	long long writes;
+};
+typedef struct out_queue OutQueue;
+
+/* Allocates a chunk of len bytes for the caller to fill in, with one
+ * reference owned by the caller. Returns NULL on failure.
+ */
+OutChunk *alloc_chunk(int);
+
+/* Allocates a chunk holding a copy of the first buflen bytes of buf, with
+ * one reference owned by the caller. Returns NULL on failure.
+ */
+OutChunk *new_chunk(const char *, int);
+
+/* Allocates a chunk standing for len bytes of the file open as fd, from
+ * offset on, with one reference owned by the caller. The chunk holds its
+ * own descriptor of the file. Returns NULL on failure.
+ */
+OutChunk *new_file_chunk(int, off_t, int);
+
+/* Drops a reference to a chunk, freeing it once nobody holds it.
+ */
+void release_chunk(OutChunk *);
+
+/* Adds a reference to chunk to the end of the given queue, skipping its
+ * first offset bytes. A non-zero offset is only allowed on an empty queue.
+ * Returns 0 on success, -1 otherwise.
+ */
+int enqueue_chunk(OutQueue *, OutChunk *, int);
+
+/* Copies buflen bytes of buf to the end of the given queue.
+ * Returns 0 on success, -1 otherwise.
+ */
+int enqueue_buf(OutQueue *, const char *, int);
+
+/* Drops the first chunk of a non-empty queue.
+ */
+void drop_first_chunk(OutQueue *);
+
+/* Drops the oldest droppable chunks from the given queue, except for one
+ * that is partly written and the first keep chunks, until it holds at most
+ * target bytes in memory. Returns the number of bytes dropped.
+ */
+int drop_oldest_chunks(OutQueue *, int, int);
+
+/* Returns the number of queued bytes held in memory, leaving out file
+ * chunks.
+ */
+int queue_memory(OutQueue *);
+
+/* Writes as much of the queue as possible to fd without blocking, and
+ * drops every chunk that was completely written. Every system call it makes
+ * is counted in the queue's writes.
+ * Returns the number of bytes still queued, or -1 on a write error.
+ */
+int flush_queue(int, OutQueue *);
+
+/* Points up to max iovecs at the chunks held in memory at the front of the
+ * queue, stopping at the first file chunk. Returns the number filled in.
+ */
+int queue_iov(OutQueue *, struct iovec *, int);
+
+/* Drops the first nbytes queued, which were written elsewhere.
+ */
+void advance_queue(OutQueue *, int);
+
+/* Releases every chunk held by a queue and resets it.
+ */
+void empty_queue(OutQueue *);
+
+#endif
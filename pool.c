@@ -0,0 +1,93 @@
+#include <stdlib.h>
+
+#include "pool.h"
+
+// Objects sitting on a free list are poisoned, so ASan still catches uses
+// of them after they were given back
+#ifdef __SANITIZE_ADDRESS__
+    #include <sanitizer/asan_interface.h>
+#else
+    #define ASAN_POISON_MEMORY_REGION(addr, size) ((void) (addr), (void) (size))
+    #define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void) (addr), (void) (size))
+#endif
+
+struct pool_slab {
+	struct pool_slab *next;
+	char objects[] __attribute__((aligned));
+};
+
+/* Returns the distance between objects in a slab, which keeps every one of
+ * them aligned like malloc() would, and large enough for a free list link.
+ */
+static size_t object_stride(Pool *pool) {
+    size_t align = __BIGGEST_ALIGNMENT__;
+    size_t size = pool->size < sizeof(void *) ? sizeof(void *) : pool->size;
+    return (size + align - 1) / align * align;
+}
+
+/* Puts an object on the free list of the given pool. */
+static void push_free(Pool *pool, void *object) {
+    *(void **) object = pool->free;
+    pool->free = object;
+    ASAN_POISON_MEMORY_REGION(object, object_stride(pool));
+}
+
+/* Allocates one more slab for the given pool and puts all of its objects
+ * on the free list. Returns 0 on success, -1 otherwise.
+ */
+static int add_slab(Pool *pool) {
+    size_t stride = object_stride(pool);
+    struct pool_slab *slab = malloc(sizeof(struct pool_slab) + 
+                                    stride * pool->per_slab);
+    if (slab == NULL) {
+        return -1;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->slots += pool->per_slab;
+
+    // Thread the free list through the new objects, first one first
+    for (int i = pool->per_slab - 1; i >= 0; i--) {
+        push_free(pool, slab->objects + i * stride);
+    }
+    return 0;
+}
+
+void* pool_alloc(Pool *pool) {
+    if (pool->free == NULL && add_slab(pool) < 0) {
+        return NULL;
+    }
+
+    void **object = pool->free;
+    ASAN_UNPOISON_MEMORY_REGION(object, object_stride(pool));
+    pool->free = *object;
+    pool->used++;
+    return object;
+}
+
+void pool_free(Pool *pool, void *object) {
+    push_free(pool, object);
+    pool->used--;
+}
+
+int reserve_pool(Pool *pool, int count) {
+    while (pool->slots < count) {
+        if (add_slab(pool) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void empty_pool(Pool *pool) {
+    while (pool->slabs != NULL) {
+        struct pool_slab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        ASAN_UNPOISON_MEMORY_REGION(slab->objects, 
+                                    object_stride(pool) * pool->per_slab);
+        free(slab);
+    }
+    pool->free = NULL;
+    pool->used = 0;
+    pool->slots = 0;
+}
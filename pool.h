@@ -0,0 +1,47 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+
+/* A pool of objects of one size, carved out of slabs of per_slab objects.
+ * Freed objects go on a free list and are handed out again before a new
+ * slab is allocated, so busy paths allocate without calling malloc().
+ * Slabs are only given back to the system by empty_pool().
+ */
+struct pool_slab;
+
+struct pool {
+	size_t size;
+	int per_slab;
+	void *free;
+	struct pool_slab *slabs;
+	int used;
+	int slots;
+};
+typedef struct pool Pool;
+
+/* Initializes a pool of objects of the given size, for a static Pool.
+ */
+#define POOL_INITIALIZER(size, per_slab) {(size), (per_slab), NULL, NULL, 0, 0}
+
+/* Returns an object from the given pool, with unspecified contents, or
+ * NULL if a new slab could not be allocated.
+ */
+void* pool_alloc(Pool*);
+
+/* Gives an object back to the pool it came from.
+ */
+void pool_free(Pool*, void*);
+
+/* Allocates slabs up front until the given pool has room for count
+ * objects, so they can later be handed out without calling malloc().
+ * Returns 0 on success, -1 otherwise.
+ */
+int reserve_pool(Pool*, int);
+
+/* Frees every slab of the given pool, along with any object still in use,
+ * and resets it.
+ */
+void empty_pool(Pool*);
+
+#endif
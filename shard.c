@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "shard.h"
+
+// Keys of entries never used, and of entries whose job is gone
+#define KEY_EMPTY 0ULL
+#define KEY_TOMBSTONE (~0ULL)
+
+// Pids of the other shards, kept by shard 0 only
+static pid_t shard_pids[MAX_SHARDS];
+static int forked_shards;
+
+int start_shards(int count, int links[]) {
+    // fds[i][j] is the end of the link between shards i and j that i holds
+    int fds[MAX_SHARDS][MAX_SHARDS];
+    for (int i = 0; i < count; i++) {
+        for (int j = i + 1; j < count; j++) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+                perror("socketpair");
+                return -1;
+            }
+            fds[i][j] = pair[0];
+            fds[j][i] = pair[1];
+        }
+    }
+
+    int self = 0;
+    pid_t parent = getpid();
+    for (int shard = 1; shard < count; shard++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            // The shards forked so far exit along with this one
+            perror("fork");
+            return -1;
+        }
+        if (pid == 0) {
+            self = shard;
+            forked_shards = 0;
+            prctl(PR_SET_PDEATHSIG, SIGINT);
+            if (getppid() != parent) {
+                raise(SIGINT);
+            }
+            break;
+        }
+        shard_pids[shard] = pid;
+        forked_shards = shard;
+    }
+
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < count; j++) {
+            if (i == self) {
+                links[j] = j == self ? -1 : fds[i][j];
+            } else if (i != j) {
+                close(fds[i][j]);
+            }
+        }
+    }
+    return self;
+}
+
+void stop_shards(void) {
+    for (int shard = 1; shard <= forked_shards; shard++) {
+        if (shard_pids[shard] > 0) {
+            kill(shard_pids[shard], SIGINT);
+        }
+    }
+    for (int shard = 1; shard <= forked_shards; shard++) {
+        if (shard_pids[shard] > 0) {
+            waitpid(shard_pids[shard], NULL, 0);
+        }
+    }
+    forked_shards = 0;
+}
+
+int reap_shard(int pid) {
+    for (int shard = 1; shard <= forked_shards; shard++) {
+        if (shard_pids[shard] == pid) {
+            shard_pids[shard] = 0;
+            return shard;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Directory
+ */
+
+/* Packs a pid and a shard into a key that is never KEY_EMPTY. */
+static unsigned long long entry_key(int shard, int pid) {
+    return ((unsigned long long)(shard + 1) << 32) | (unsigned int) pid;
+}
+
+/* Returns the first slot to probe for a pid. */
+static int directory_slot(ShardDirectory *directory, int pid) {
+    return ((unsigned int) pid * 2654435761u) & (directory->size - 1);
+}
+
+/* Returns the slot holding the given key, or -1 if there is none. */
+static int find_entry(ShardDirectory *directory, unsigned long long key) {
+    int pid = key & 0xffffffffu;
+    int slot = directory_slot(directory, pid);
+    for (int i = 0; i < directory->size; i++) {
+        unsigned long long found = __atomic_load_n(
+                &(directory->entries[slot].key), __ATOMIC_ACQUIRE);
+        if (found == key) {
+            return slot;
+        }
+        if (found == KEY_EMPTY) {
+            return -1;
+        }
+        slot = (slot + 1) & (directory->size - 1);
+    }
+    return -1;
+}
+
+ShardDirectory *new_shard_directory(int size) {
+    size_t bytes = sizeof(ShardDirectory) + size * sizeof(DirectoryEntry);
+    ShardDirectory *directory = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (directory == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    directory->size = size;
+    for (int i = 0; i < size; i++) {
+        directory->entries[i].journal_len = -1;
+    }
+    return directory;
+}
+
+int publish_job(ShardDirectory *directory, int shard, int pid) {
+    unsigned long long key = entry_key(shard, pid);
+
+    // The journal of an earlier job with the same pid goes with this one
+    int slot = find_entry(directory, key);
+    if (slot >= 0) {
+        DirectoryEntry *entry = &(directory->entries[slot]);
+        __atomic_store_n(&(entry->journal_len), -1, __ATOMIC_RELAXED);
+        __atomic_store_n(&(entry->running), 1, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    slot = directory_slot(directory, pid);
+    for (int i = 0; i < directory->size; i++) {
+        DirectoryEntry *entry = &(directory->entries[slot]);
+        unsigned long long old = __atomic_load_n(&(entry->key),
+                                                 __ATOMIC_ACQUIRE);
+        if ((old == KEY_EMPTY || old == KEY_TOMBSTONE) &&
+                __atomic_compare_exchange_n(&(entry->key), &old, key, 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&(entry->running), 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        slot = (slot + 1) & (directory->size - 1);
+    }
+    return -1;
+}
+
+void stop_published_job(ShardDirectory *directory, int shard, int pid) {
+    int slot = find_entry(directory, entry_key(shard, pid));
+    if (slot >= 0) {
+        __atomic_store_n(&(directory->entries[slot].running), 0,
+                         __ATOMIC_RELEASE);
+    }
+}
+
+void publish_journal_len(ShardDirectory *directory, int shard, int pid,
+                         long long len) {
+    int slot = find_entry(directory, entry_key(shard, pid));
+    if (slot >= 0) {
+        __atomic_store_n(&(directory->entries[slot].journal_len), len,
+                         __ATOMIC_RELEASE);
+    }
+}
+
+void withdraw_job(ShardDirectory *directory, int shard, int pid) {
+    int slot = find_entry(directory, entry_key(shard, pid));
+    if (slot < 0) {
+        return;
+    }
+    // The entry is reset before it can be reused
+    DirectoryEntry *entry = &(directory->entries[slot]);
+    __atomic_store_n(&(entry->running), 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&(entry->journal_len), -1, __ATOMIC_RELAXED);
+    __atomic_store_n(&(entry->key), KEY_TOMBSTONE, __ATOMIC_RELEASE);
+}
+
+int lookup_job(ShardDirectory *directory, int pid, DirectoryEntry *entry) {
+    int shard = -1;
+    int slot = directory_slot(directory, pid);
+    for (int i = 0; i < directory->size; i++) {
+        DirectoryEntry *found = &(directory->entries[slot]);
+        unsigned long long key = __atomic_load_n(&(found->key),
+                                                 __ATOMIC_ACQUIRE);
+        if (key == KEY_EMPTY) {
+            break;
+        }
+        if (key != KEY_TOMBSTONE && (int)(key & 0xffffffffu) == pid &&
+                (shard < 0 || !entry->running)) {
+            entry->key = key;
+            entry->running = __atomic_load_n(&(found->running),
+                                             __ATOMIC_ACQUIRE);
+            entry->journal_len = __atomic_load_n(&(found->journal_len),
+                                                 __ATOMIC_ACQUIRE);
+            shard = (key >> 32) - 1;
+        }
+        slot = (slot + 1) & (directory->size - 1);
+    }
+    return shard;
+}
+
+int list_other_jobs(ShardDirectory *directory, int shard, int pids[],
+                    int max) {
+    int count = 0;
+    for (int i = 0; i < directory->size && count < max; i++) {
+        DirectoryEntry *entry = &(directory->entries[i]);
+        unsigned long long key = __atomic_load_n(&(entry->key),
+                                                 __ATOMIC_ACQUIRE);
+        if (key != KEY_EMPTY && key != KEY_TOMBSTONE &&
+                (int)(key >> 32) - 1 != shard &&
+                __atomic_load_n(&(entry->running), __ATOMIC_ACQUIRE)) {
+            pids[count++] = key & 0xffffffffu;
+        }
+    }
+    return count;
+}
+
+/*
+ *  Remote jobs
+ */
+
+RemoteJob *find_remote_job(RemoteJobList *remote_jobs, int pid) {
+    for (RemoteJob *remote = remote_jobs->first; remote != NULL;
+            remote = remote->next) {
+        if (remote->pid == pid) {
+            return remote;
+        }
+    }
+    return NULL;
+}
+
+RemoteJob *add_remote_job(RemoteJobList *remote_jobs, int pid, int shard) {
+    RemoteJob *remote = malloc(sizeof(RemoteJob));
+    if (remote == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memset(remote, 0, sizeof(RemoteJob));
+    remote->pid = pid;
+    remote->shard = shard;
+    remote->next = remote_jobs->first;
+    remote_jobs->first = remote;
+    remote_jobs->count++;
+    return remote;
+}
+
+void delete_remote_job(RemoteJobList *remote_jobs, RemoteJob *remote) {
+    RemoteJob **link = &(remote_jobs->first);
+    while (*link != remote) {
+        link = &((*link)->next);
+    }
+    *link = remote->next;
+    remote_jobs->count--;
+
+    empty_watcher_list(&(remote->watcher_list));
+    free(remote);
+}
+
+/*
+ *  Relays
+ */
+
+int add_relay(RelayTable *relays, Client *client, unsigned int request_id) {
+    int slot = 0;
+    while (slot < relays->size && relays->slots[slot].busy) {
+        slot++;
+    }
+    if (slot == relays->size) {
+        int size = relays->size > 0 ? relays->size * 2 : 16;
+        Relay *slots = realloc(relays->slots, size * sizeof(Relay));
+        if (slots == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        memset(slots + relays->size, 0,
+               (size - relays->size) * sizeof(Relay));
+        relays->slots = slots;
+        relays->size = size;
+    }
+
+    Relay *relay = &(relays->slots[slot]);
+    relay->busy = 1;
+    relay->client = client;
+    relay->request_id = request_id;
+    relays->busy++;
+    return slot + 1;
+}
+
+Relay *find_relay(RelayTable *relays, unsigned int id) {
+    if (id == 0 || id > (unsigned int) relays->size ||
+            !relays->slots[id - 1].busy) {
+        return NULL;
+    }
+    return &(relays->slots[id - 1]);
+}
+
+void free_relay(RelayTable *relays, unsigned int id) {
+    Relay *relay = find_relay(relays, id);
+    if (relay != NULL) {
+        memset(relay, 0, sizeof(Relay));
+        relays->busy--;
+    }
+}
+
+void drop_client_relays(RelayTable *relays, Client *client) {
+    for (int slot = 0; slot < relays->size; slot++) {
+        if (relays->slots[slot].client == client) {
+            relays->slots[slot].client = NULL;
+        }
+    }
+}
+
+void empty_relay_table(RelayTable *relays) {
+    free(relays->slots);
+    memset(relays, 0, sizeof(RelayTable));
+}
@@ -0,0 +1,181 @@
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include "jobprotocol.h"
+
+// Most shards the server may be split into, see -s
+#ifndef MAX_SHARDS
+    #define MAX_SHARDS 64
+#endif
+
+// Entries in the directory of jobs shared by all shards, must be a power
+// of 2
+#ifndef DIRECTORY_SIZE
+    #define DIRECTORY_SIZE 8192
+#endif
+
+// Frames whose id has this bit set start or stop a link's watch of a job
+// on another shard, and have the job's pid in the other bits
+#define REMOTE_WATCH_ID 0x80000000u
+
+/* A server split into shards runs one process per shard, each with its
+ * own event loop, listening socket, clients and jobs, and nothing else in
+ * common but the directory below. Every pair of shards is joined by a
+ * link, a socket pair over which each side is a binary mode client of the
+ * other: it sends commands about the jobs that run there, and gets their
+ * answers and the output of the jobs it watches back in frames.
+ */
+
+/* Where a job runs. The pid and shard are packed into one key, so an entry
+ * is claimed with a single compare-and-swap. Only the shard running a job
+ * writes its entry afterwards. journal_len is the number of bytes of its
+ * journal, which other shards read from its file, or -1 if it has none.
+ */
+struct directory_entry {
+	unsigned long long key;
+	long long journal_len;
+	int running;
+};
+typedef struct directory_entry DirectoryEntry;
+
+/* The pids of the jobs of every shard, in an open-addressing (linear
+ * probing) hash table in memory shared by all of them. Entries of jobs
+ * that are gone are left as tombstones, which later jobs reuse.
+ */
+struct shard_directory {
+	int size;
+	struct directory_entry entries[];
+};
+typedef struct shard_directory ShardDirectory;
+
+/* A job of another shard that clients of this one watch. Its link watches
+ * it on their behalf, and its output is passed on to them.
+ */
+struct remote_job {
+	int pid;
+	int shard;
+	struct watcher_list watcher_list;
+	struct remote_job *next;
+};
+typedef struct remote_job RemoteJob;
+
+/* Remotely watched jobs. Few are watched at once, so they are kept in a
+ * plain list.
+ */
+struct remote_job_list {
+	struct remote_job *first;
+	int count;
+};
+typedef struct remote_job_list RemoteJobList;
+
+/* A command forwarded to another shard on behalf of a client, whose answer
+ * comes back with the slot's index plus one as id. The slot stays busy
+ * until the answer ends, even if the client leaves before.
+ */
+struct relay {
+	int busy;
+	struct client *client;
+	unsigned int request_id;
+};
+typedef struct relay Relay;
+
+struct relay_table {
+	struct relay *slots;
+	int size;
+	int busy;
+};
+typedef struct relay_table RelayTable;
+
+/* Splits the server into count shards by forking count - 1 processes,
+ * and joins every pair of them with a link. The calling process becomes
+ * shard 0, and the others exit once it does. Stores the link to each other
+ * shard in links, and -1 for this one.
+ * Returns the index of the shard of the calling process, or -1 if the
+ * server could not be split.
+ */
+int start_shards(int, int[]);
+
+/* Interrupts every other shard and waits for it to exit, when called from
+ * shard 0.
+ */
+void stop_shards(void);
+
+/* Returns the shard whose process shard 0 reaped with the given pid, and
+ * forgets the process so stop_shards() leaves it alone. Returns -1 if the
+ * pid is not that of a shard.
+ */
+int reap_shard(int);
+
+/* Allocates a directory with the given number of entries, in memory that
+ * processes forked afterwards share. Returns NULL on failure.
+ */
+ShardDirectory* new_shard_directory(int);
+
+/* Records that the given shard runs the job with the given pid, without a
+ * journal for now. Returns 0 on success, -1 if the directory is full.
+ */
+int publish_job(ShardDirectory*, int, int);
+
+/* Records that a job of the given shard is done, but its journal is kept.
+ */
+void stop_published_job(ShardDirectory*, int, int);
+
+/* Records the length of the journal of a job of the given shard.
+ */
+void publish_journal_len(ShardDirectory*, int, int, long long);
+
+/* Removes a job of the given shard from the directory.
+ */
+void withdraw_job(ShardDirectory*, int, int);
+
+/* Copies the entry of the job with the given pid into entry, preferring
+ * that of a running job when the pid was reused.
+ * Returns the shard of the job, or -1 if it is not found.
+ */
+int lookup_job(ShardDirectory*, int, DirectoryEntry*);
+
+/* Stores up to max pids of running jobs of shards other than the given one
+ * in pids. Returns the number stored.
+ */
+int list_other_jobs(ShardDirectory*, int, int[], int);
+
+/* Returns the remotely watched job with the given pid, or NULL if it is
+ * not watched.
+ */
+RemoteJob* find_remote_job(RemoteJobList*, int);
+
+/* Adds a job of the given shard, watched by nobody yet, to the list.
+ * Returns it, or NULL on failure.
+ */
+RemoteJob* add_remote_job(RemoteJobList*, int, int);
+
+/* Removes a remotely watched job from the list, drops its watchers and
+ * frees it.
+ */
+void delete_remote_job(RemoteJobList*, RemoteJob*);
+
+/* Takes a free slot in the given table for a command of the given client
+ * with the given request id. Returns the id the command is to be forwarded
+ * with, or -1 if the table could not grow.
+ */
+int add_relay(RelayTable*, Client*, unsigned int);
+
+/* Returns the busy slot forwarded with the given id, or NULL if there is
+ * none.
+ */
+Relay* find_relay(RelayTable*, unsigned int);
+
+/* Frees the slot forwarded with the given id.
+ */
+void free_relay(RelayTable*, unsigned int);
+
+/* Forgets the given client in every busy slot, so answers to its commands
+ * are dropped.
+ */
+void drop_client_relays(RelayTable*, Client*);
+
+/* Frees the slots of a relay table and resets it.
+ */
+void empty_relay_table(RelayTable*);
+
+#endif
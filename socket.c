@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,10 +30,13 @@ struct sockaddr_in *init_server_addr(int port) {
 }
 
 /*
- * Create and setup a socket for a server to listen on.
+ * Create and setup a socket for a server to listen on. With reuse_port,
+ * several sockets may listen on the same port, and the kernel spreads new
+ * connections over them.
  */
-int setup_server_socket(struct sockaddr_in *self, int num_queue) {
-    int soc = socket(PF_INET, SOCK_STREAM, 0);
+int setup_server_socket(struct sockaddr_in *self, int num_queue, 
+                        int reuse_port) {
+    int soc = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (soc < 0) {
         perror("socket");
         exit(1);
@@ -46,6 +51,11 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
         perror("setsockopt");
         exit(1);
     }
+    if (reuse_port && setsockopt(soc, SOL_SOCKET, SO_REUSEPORT, 
+            (const char *) &on, sizeof(on)) < 0) {
+        perror("setsockopt");
+        exit(1);
+    }
 
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)self, sizeof(*self)) < 0) {
@@ -66,7 +76,7 @@ int setup_server_socket(struct sockaddr_in *self, int num_queue) {
 
 
 /*
- * Wait for and accept a new connection.
+ * Wait for and accept a new connection. The new socket is close-on-exec.
  * Return -1 if the accept call failed.
  */
 int accept_connection(int listenfd) {
@@ -75,7 +85,8 @@ int accept_connection(int listenfd) {
     peer.sin_family = PF_INET;
 
     fprintf(stderr, "Waiting for a new connection...\n");
-    int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
+    int client_socket = accept4(listenfd, (struct sockaddr *)&peer, &peer_len, 
+                                SOCK_CLOEXEC);
     if (client_socket < 0) {
         perror("accept");
         return -1;
@@ -4,7 +4,8 @@
 #include <netinet/in.h>    /* Internet domain header, for struct sockaddr_in */
 
 struct sockaddr_in *init_server_addr(int port);
-int setup_server_socket(struct sockaddr_in *self, int num_queue);
+int setup_server_socket(struct sockaddr_in *self, int num_queue, 
+                        int reuse_port);
 int accept_connection(int listenfd);
 
 int connect_to_server(int port, const char *hostname);
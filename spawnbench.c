@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "jobprotocol.h"
+
+/* Compares how long start_job() (posix_spawn) and start_job_forked() (fork)
+ * keep the server busy launching a job, while the process holds a given
+ * amount of touched memory to stand in for a large server.
+ *
+ * Usage: spawnbench [iterations] [resident MiB]
+ */
+
+#define DEFAULT_ITERATIONS 200
+#define DEFAULT_RESIDENT_MB 256
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+double elapsed_us(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e6 + 
+           (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+/* Launches /bin/true the given number of times with launch, and prints
+ * latency percentiles for the launch call alone.
+ */
+void run_benchmark(const char *name, JobNode *(*launch)(char *, char *const[]),
+                   int iterations) {
+    char *args[] = {"true", NULL};
+    double *samples = malloc(iterations * sizeof(double));
+    if (samples == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    for (int i = 0; i < iterations; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        JobNode *job = launch("/bin/true", args);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (job == NULL) {
+            exit(1);
+        }
+        samples[i] = elapsed_us(&start, &end);
+
+        waitpid(job->pid, NULL, 0);
+        delete_job_node(job);
+    }
+
+    qsort(samples, iterations, sizeof(double), compare_doubles);
+    double total = 0;
+    for (int i = 0; i < iterations; i++) {
+        total += samples[i];
+    }
+    printf("%-12s mean %9.1fus  p50 %9.1fus  p99 %9.1fus  max %9.1fus\n", 
+           name, total / iterations, samples[iterations / 2], 
+           samples[iterations * 99 / 100], samples[iterations - 1]);
+    free(samples);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+    long resident_mb = argc > 2 ? strtol(argv[2], NULL, 10) : DEFAULT_RESIDENT_MB;
+    if (iterations <= 0 || resident_mb < 0) {
+        fprintf(stderr, "Usage: %s [iterations] [resident MiB]\n", argv[0]);
+        return 1;
+    }
+
+    // Touch every page, so fork has page tables to copy
+    size_t resident = resident_mb * 1024 * 1024;
+    char *ballast = malloc(resident + 1);
+    if (ballast == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memset(ballast, 1, resident);
+
+    printf("%d launches with %ld MiB resident\n", iterations, resident_mb);
+    run_benchmark("posix_spawn", start_job, iterations);
+    run_benchmark("fork", start_job_forked, iterations);
+
+    free(ballast);
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "jobprotocol.h"
+#include "linesplit.h"
+
+/* Compares how fast job output is split into lines by every line splitter,
+ * finding up to 256 lines per pass like the server does, against scanning
+ * for one line at a time with find_unix_newline() and with the byte by
+ * byte scan it used to do. The output is read in chunks of the size of a
+ * full job buffer.
+ *
+ * Usage: splitbench [line length] [MiB of output] [rounds]
+ */
+
+#define DEFAULT_LINE_LENGTH 80
+#define DEFAULT_OUTPUT_MB 64
+#define DEFAULT_ROUNDS 5
+#define SPLIT_BATCH 256
+
+double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + 
+           (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* The scan find_unix_newline() did before it used memchr(). */
+int find_newline_bytes(const char *buf, int n) {
+    for (int i = 0; i < n; i++) {
+        if (buf[i] == '\n') {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/* Splits a chunk one line at a time with scan, returns the number of lines.
+ */
+long split_one_by_one(const char *buf, int n, int (*scan)(const char *, int)) {
+    long lines = 0;
+    int consumed = 0;
+    int length;
+    while ((length = scan(buf + consumed, n - consumed)) > 0) {
+        consumed += length;
+        lines++;
+    }
+    return lines;
+}
+
+/* Splits a chunk in batches with split, returns the number of lines.
+ */
+long split_batches(const char *buf, int n, SplitFunction split) {
+    int ends[SPLIT_BATCH];
+    long lines = 0;
+    int consumed = 0;
+    int count;
+    while ((count = split(buf + consumed, n - consumed, ends, SPLIT_BATCH)) > 0) {
+        consumed += ends[count - 1];
+        lines += count;
+    }
+    return lines;
+}
+
+/* Prints the throughput of splitting the output with either split or scan,
+ * whichever is not NULL, over the given number of rounds.
+ */
+void run_benchmark(const char *name, const char *output, size_t size, 
+                   int rounds, SplitFunction split, 
+                   int (*scan)(const char *, int)) {
+    long lines = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < rounds; round++) {
+        for (size_t offset = 0; offset < size; offset += MAX_BUFSIZE) {
+            int n = size - offset < MAX_BUFSIZE ? size - offset : MAX_BUFSIZE;
+            if (split != NULL) {
+                lines += split_batches(output + offset, n, split);
+            } else {
+                lines += split_one_by_one(output + offset, n, scan);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsed_s(&start, &end);
+    printf("%-20s %9.1f MiB/s  %7.2f ns/line  %ld lines\n", name, 
+           (double) size * rounds / (1024 * 1024) / seconds, 
+           seconds * 1e9 / lines, lines / rounds);
+}
+
+int main(int argc, char **argv) {
+    int line_length = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_LINE_LENGTH;
+    long output_mb = argc > 2 ? strtol(argv[2], NULL, 10) : DEFAULT_OUTPUT_MB;
+    int rounds = argc > 3 ? strtol(argv[3], NULL, 10) : DEFAULT_ROUNDS;
+    if (line_length <= 0 || output_mb <= 0 || rounds <= 0) {
+        fprintf(stderr, "Usage: %s [line length] [MiB of output] [rounds]\n", 
+                argv[0]);
+        return 1;
+    }
+
+    // Lines vary between half and one and a half times the given length
+    size_t size = output_mb * 1024 * 1024;
+    char *output = malloc(size);
+    if (output == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    srand(1);
+    size_t offset = 0;
+    while (offset < size) {
+        int length = line_length / 2 + rand() % (line_length + 1);
+        for (int i = 0; i < length && offset < size; i++) {
+            output[offset++] = 'a' + i % 26;
+        }
+        if (offset < size) {
+            output[offset++] = '\n';
+        }
+    }
+
+    printf("%ld MiB of lines of about %d characters, %d rounds, using %s\n", 
+           output_mb, line_length, rounds, line_splitter_name());
+    run_benchmark("one by one, bytes", output, size, rounds, NULL, 
+                  find_newline_bytes);
+    run_benchmark("one by one, memchr", output, size, rounds, NULL, 
+                  find_unix_newline);
+    for (int i = 0; i < n_line_splitters; i++) {
+        if (line_splitters[i].supported()) {
+            char name[64];
+            snprintf(name, sizeof(name), "batch, %s", line_splitters[i].name);
+            run_benchmark(name, output, size, rounds, line_splitters[i].split, 
+                          NULL);
+        }
+    }
+
+    free(output);
+    return 0;
+}
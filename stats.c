@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+ServerStats stats;
+
+long long monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+/* Formats one histogram into a line and passes it to emit.
+ */
+static void report_histogram(void (*emit)(void *, char *), void *arg, 
+                             const char *name, Histogram *hist) {
+    char line[256];
+    snprintf(line, sizeof(line), 
+             "%s: count %lld mean %lld p50 %lld p99 %lld p999 %lld max %lld", 
+             name, hist->count, hist->count ? hist->sum / hist->count : 0, 
+             get_percentile(hist, 50), get_percentile(hist, 99), 
+             get_percentile(hist, 99.9), hist->max);
+    emit(arg, line);
+}
+
+void report_stats(void (*emit)(void *, char *), void *arg) {
+    char line[256];
+
+    snprintf(line, sizeof(line), 
+             "loop: wakeups %lld events %lld commands %lld bytes in %lld", 
+             stats.wakeups, stats.events, stats.commands, 
+             stats.client_bytes_read);
+    emit(arg, line);
+    snprintf(line, sizeof(line), "clients: accepted %lld refused %lld", 
+             stats.clients_accepted, stats.clients_refused);
+    emit(arg, line);
+    snprintf(line, sizeof(line), 
+             "jobs: started %lld failed %lld exited %lld bytes %lld lines %lld", 
+             stats.jobs_started, stats.jobs_failed, stats.jobs_exited, 
+             stats.job_bytes_read, stats.job_lines_read);
+    emit(arg, line);
+    snprintf(line, sizeof(line), 
+             "writes: bytes %lld partial %lld dropped %lld slow clients %lld "
+             "calls %lld", stats.bytes_sent, stats.partial_writes, 
+             stats.dropped_writes, stats.slow_disconnects, stats.write_calls);
+    emit(arg, line);
+    snprintf(line, sizeof(line), 
+             "flow: paused %lld resumed %lld drops %lld dropped bytes %lld "
+             "killed %lld", stats.flow_pauses, stats.flow_resumes, 
+             stats.flow_drops, stats.flow_dropped_bytes, stats.flow_kills);
+    emit(arg, line);
+    snprintf(line, sizeof(line), "journal: bytes %lld", stats.journal_bytes);
+    emit(arg, line);
+    snprintf(line, sizeof(line), "raw: spliced bytes %lld copied bytes %lld", 
+             stats.raw_spliced_bytes, stats.raw_copied_bytes);
+    emit(arg, line);
+    snprintf(line, sizeof(line), 
+             "remote: forwarded commands %lld lines %lld", 
+             stats.shard_commands, stats.shard_lines);
+    emit(arg, line);
+    snprintf(line, sizeof(line), "uring: submits %lld sends %lld accepts %lld",
+             stats.uring_submits, stats.uring_sends, stats.uring_accepts);
+    emit(arg, line);
+    snprintf(line, sizeof(line), "filters: evaluated lines %lld matched %lld", 
+             stats.filter_evals, stats.filter_hits);
+    emit(arg, line);
+
+    report_histogram(emit, arg, "events per wakeup", &stats.events_per_wakeup);
+    report_histogram(emit, arg, "spawn latency us", &stats.spawn_latency);
+    report_histogram(emit, arg, "job lifetime ms", &stats.job_lifetime_ms);
+    report_histogram(emit, arg, "bytes per job", &stats.job_bytes);
+    report_histogram(emit, arg, "lines per job", &stats.job_lines);
+    report_histogram(emit, arg, "lines per batch", &stats.lines_per_batch);
+    report_histogram(emit, arg, "watchers per line", &stats.watchers_per_line);
+    report_histogram(emit, arg, "bytes per client", &stats.client_bytes_sent);
+    report_histogram(emit, arg, "queued bytes", &stats.queue_depth);
+}
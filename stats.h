@@ -0,0 +1,65 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "histogram.h"
+
+/* Counters and histograms updated on the server's hot paths. They are plain
+ * integers bumped from the single-threaded main loop, so keeping them on
+ * costs next to nothing. Times are in microseconds unless noted otherwise.
+ */
+struct server_stats {
+	long long wakeups;
+	long long events;
+	long long commands;
+	long long client_bytes_read;
+	long long clients_accepted;
+	long long clients_refused;
+	long long jobs_started;
+	long long jobs_failed;
+	long long jobs_exited;
+	long long job_bytes_read;
+	long long job_lines_read;
+	long long bytes_sent;
+	long long partial_writes;
+	long long write_calls;
+	long long dropped_writes;
+	long long slow_disconnects;
+	long long flow_pauses;
+	long long flow_resumes;
+	long long flow_drops;
+	long long flow_dropped_bytes;
+	long long flow_kills;
+	long long journal_bytes;
+	long long raw_spliced_bytes;
+	long long raw_copied_bytes;
+	long long shard_commands;
+	long long shard_lines;
+	long long uring_submits;
+	long long uring_sends;
+	long long uring_accepts;
+	long long filter_evals;
+	long long filter_hits;
+	struct histogram events_per_wakeup;
+	struct histogram spawn_latency;
+	struct histogram job_lifetime_ms;
+	struct histogram job_bytes;
+	struct histogram job_lines;
+	struct histogram lines_per_batch;
+	struct histogram watchers_per_line;
+	struct histogram client_bytes_sent;
+	struct histogram queue_depth;
+};
+typedef struct server_stats ServerStats;
+
+extern ServerStats stats;
+
+/* Returns the CLOCK_MONOTONIC time in microseconds.
+ */
+long long monotonic_us(void);
+
+/* Formats every counter and histogram in stats into lines of text, and
+ * passes each of them to emit along with arg.
+ */
+void report_stats(void (*emit)(void *, char *), void *);
+
+#endif
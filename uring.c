@@ -0,0 +1,109 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+// Features the server counts on, see init_uring()
+#define URING_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | \
+                        IORING_FEAT_SUBMIT_STABLE)
+
+int init_uring(Uring *ring, unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    if ((params.features & URING_FEATURES) != URING_FEATURES) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // Both rings share a single mapping
+    size_t sq_size = params.sq_off.array +
+                     params.sq_entries * sizeof(unsigned int);
+    size_t cq_size = params.cq_off.cqes +
+                     params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->rings, ring->rings_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *rings = ring->rings;
+    ring->sq_head = (unsigned int *)(rings + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(rings + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(rings + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned int *)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(rings + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    // Entries are always submitted in order, so slot i holds entry i
+    unsigned int *array = (unsigned int *)(rings + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    return 0;
+}
+
+struct io_uring_sqe *get_sqe(Uring *ring) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *(ring->sq_tail) + ring->prepared;
+    if (tail - head > *(ring->sq_mask)) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &(ring->sqes[tail & *(ring->sq_mask)]);
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->prepared++;
+    return sqe;
+}
+
+int submit_uring(Uring *ring, unsigned int wait) {
+    unsigned int count = ring->prepared;
+    __atomic_store_n(ring->sq_tail, *(ring->sq_tail) + count,
+                     __ATOMIC_RELEASE);
+    ring->prepared = 0;
+
+    unsigned int flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, ring->fd, count, wait, flags,
+                         NULL, 0);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+struct io_uring_cqe *peek_cqe(Uring *ring) {
+    unsigned int head = *(ring->cq_head);
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &(ring->cqes[head & *(ring->cq_mask)]);
+}
+
+void seen_cqe(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *(ring->cq_head) + 1, __ATOMIC_RELEASE);
+}
+
+void close_uring(Uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->rings, ring->rings_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
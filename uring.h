@@ -0,0 +1,68 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+
+// Whether the server uses an io_uring without being given -u
+#ifndef USE_URING
+    #define USE_URING 0
+#endif
+
+// Entries in the submission queue of the server's io_uring, a power of 2
+#ifndef URING_ENTRIES
+    #define URING_ENTRIES 256
+#endif
+
+/* A bare io_uring, set up with the system calls themselves rather than a
+ * library. Requests are filled in one submission queue entry at a time
+ * with get_sqe(), and handed to the kernel together by submit_uring().
+ * Their completions are read back with peek_cqe() and seen_cqe().
+ */
+struct uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int prepared;
+	void *rings;
+	size_t rings_size;
+	size_t sqes_size;
+};
+typedef struct uring Uring;
+
+/* Sets up an io_uring with the given number of submission queue entries,
+ * a power of 2. The kernel must read every request at submission, so its
+ * buffers of iovecs can be reused right after.
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int init_uring(Uring *, unsigned int);
+
+/* Returns a cleared submission queue entry to fill in, or NULL if the
+ * queue is full until the next submission.
+ */
+struct io_uring_sqe *get_sqe(Uring *);
+
+/* Submits every entry filled in since the last submission with a single
+ * system call, and waits for at least wait completions.
+ * Returns the number of entries submitted, or -1 with errno set.
+ */
+int submit_uring(Uring *, unsigned int);
+
+/* Returns the oldest completion not seen yet, or NULL if there is none.
+ */
+struct io_uring_cqe *peek_cqe(Uring *);
+
+/* Hands the completion returned by peek_cqe() back to the kernel.
+ */
+void seen_cqe(Uring *);
+
+/* Unmaps the queues and closes the io_uring.
+ */
+void close_uring(Uring *);
+
+#endif